@@ -0,0 +1,4 @@
+#!/bin/sh
+# Time of the escape kernels per call, built scalar, with SSE2 and with
+# AVX2, next to bytewise implementations. Run from the source directory.
+exec sh tests/escape.sh bench
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Throughput and worker CPU time of fetching a large file over loopback.
+# Run as root from the source directory; DIRL picks the binary, so an
+# older build can be compared, SIZE the file size in MiB, RUNS the count.
+set -e
+
+dirl=${DIRL:-./dirl}
+size=${SIZE:-1024}
+runs=${RUNS:-3}
+port=${PORT:-8089}
+dir=$(mktemp -d)
+trap 'kill $pid 2>/dev/null; rm -rf "$dir"' EXIT
+
+dd if=/dev/urandom of="$dir/big" bs=1M count="$size" 2>/dev/null
+chmod -R a+rX "$dir"
+cat "$dir/big" > /dev/null
+
+"$dirl" -p "$port" -h 127.0.0.1 -d "$dir" -g nogroup -w 1 >/dev/null 2>&1 &
+pid=$!
+sleep 1
+worker=$(pgrep -P "$pid" | tail -n 1)
+
+# utime + stime of the worker in clock ticks
+cpu() {
+	awk '{ print $14 + $15 }' "/proc/$worker/stat"
+}
+
+tick=$(getconf CLK_TCK)
+i=0
+while [ "$i" -lt "$runs" ]; do
+	c0=$(cpu)
+	speed=$(curl -s -o /dev/null -w '%{speed_download}' \
+	        "http://127.0.0.1:$port/big")
+	c1=$(cpu)
+	echo "$speed $c0 $c1 $tick $size" | awk '{
+		printf "%.0f MiB/s, %.0f ms worker CPU\n", $1 / 1048576,
+		       ($3 - $2) * 1000 / $4
+	}'
+	i=$((i + 1))
+done
@@ -0,0 +1,342 @@
+/* See LICENSE file for copyright and license details. */
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "cache.h"
+#include "util.h"
+
+#define BLOCK_SIZE 4096
+#define NIL        UINT32_MAX
+
+/*
+ * An entry stores the key followed by the value in a chain of
+ * fixed-size blocks, so there is no fragmentation to deal with.
+ */
+struct entry {
+	uint64_t hash;
+	size_t keylen;
+	size_t len;      /* length of the value */
+	uint32_t block;  /* first block of the chain */
+	uint32_t hnext;  /* next entry in the bucket or free list */
+	uint32_t prev;   /* LRU neighbours */
+	uint32_t next;
+};
+
+struct cache {
+	pthread_mutex_t lock;
+	size_t nentries;
+	size_t nblocks;
+	uint32_t *bucket;
+	struct entry *entry;
+	uint32_t *bnext;   /* next block in the chain or free list */
+	char (*block)[BLOCK_SIZE];
+	uint32_t freeentry;
+	uint32_t freeblock;
+	size_t nfreeblocks;
+	uint32_t head;     /* most recently used entry */
+	uint32_t tail;     /* least recently used entry */
+};
+
+static uint64_t
+hash(const char *s, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325;
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)s[i]) * 0x100000001b3;
+	}
+
+	return h;
+}
+
+static void
+cache_clear(struct cache *c)
+{
+	size_t i;
+
+	for (i = 0; i < c->nentries; i++) {
+		c->bucket[i] = NIL;
+		c->entry[i].hnext = (i + 1 < c->nentries) ? i + 1 : NIL;
+	}
+	for (i = 0; i < c->nblocks; i++) {
+		c->bnext[i] = (i + 1 < c->nblocks) ? i + 1 : NIL;
+	}
+	c->freeentry = 0;
+	c->freeblock = 0;
+	c->nfreeblocks = c->nblocks;
+	c->head = c->tail = NIL;
+}
+
+struct cache *
+cache_create(size_t size, size_t nentries)
+{
+	pthread_mutexattr_t attr;
+	struct cache *c;
+	size_t nblocks, len;
+	char *p;
+
+	if (!size || !nentries || (nblocks = size / BLOCK_SIZE) == 0 ||
+	    nblocks >= NIL || nentries >= NIL) {
+		return NULL;
+	}
+
+	/* lay out everything in one shared mapping, blocks last */
+	len = sizeof(*c) + nentries * (sizeof(*c->bucket) +
+	      sizeof(*c->entry)) + nblocks * sizeof(*c->bnext);
+	len = (len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+	if ((p = mmap(NULL, len + nblocks * BLOCK_SIZE,
+	              PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+	              -1, 0)) == MAP_FAILED) {
+		warn("mmap:");
+		return NULL;
+	}
+	c = (struct cache *)p;
+	c->nentries = nentries;
+	c->nblocks = nblocks;
+	c->entry = (struct entry *)(p + sizeof(*c));
+	c->bucket = (uint32_t *)(c->entry + nentries);
+	c->bnext = c->bucket + nentries;
+	c->block = (char (*)[BLOCK_SIZE])(p + len);
+	cache_clear(c);
+
+	/* the lock is shared and survives workers dying while holding it */
+	if (pthread_mutexattr_init(&attr) ||
+	    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) ||
+	    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) ||
+	    pthread_mutex_init(&c->lock, &attr)) {
+		warn("pthread_mutex_init: Failed to set up the cache lock");
+		munmap(p, len + nblocks * BLOCK_SIZE);
+		return NULL;
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	return c;
+}
+
+static int
+lock(struct cache *c)
+{
+	switch (pthread_mutex_lock(&c->lock)) {
+	case 0:
+		return 0;
+	case EOWNERDEAD:
+		/* the owner died halfway through, start over */
+		cache_clear(c);
+		pthread_mutex_consistent(&c->lock);
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+static void
+unlock(struct cache *c)
+{
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* copy len bytes starting at offset off of the chain at block b */
+static void
+chain_copy(struct cache *c, uint32_t b, size_t off, char *dst,
+           const char *src, size_t len)
+{
+	size_t n;
+
+	for (; off >= BLOCK_SIZE; off -= BLOCK_SIZE) {
+		b = c->bnext[b];
+	}
+	for (; len > 0; b = c->bnext[b], off = 0) {
+		n = MIN(len, BLOCK_SIZE - off);
+		if (dst) {
+			memcpy(dst, c->block[b] + off, n);
+			dst += n;
+		} else {
+			memcpy(c->block[b] + off, src, n);
+			src += n;
+		}
+		len -= n;
+	}
+}
+
+static int
+chain_cmp(struct cache *c, uint32_t b, const char *s, size_t len)
+{
+	size_t n;
+
+	for (; len > 0; b = c->bnext[b]) {
+		n = MIN(len, BLOCK_SIZE);
+		if (memcmp(c->block[b], s, n)) {
+			return 1;
+		}
+		s += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void
+lru_unlink(struct cache *c, uint32_t i)
+{
+	if (c->entry[i].prev != NIL) {
+		c->entry[c->entry[i].prev].next = c->entry[i].next;
+	} else {
+		c->head = c->entry[i].next;
+	}
+	if (c->entry[i].next != NIL) {
+		c->entry[c->entry[i].next].prev = c->entry[i].prev;
+	} else {
+		c->tail = c->entry[i].prev;
+	}
+}
+
+static void
+lru_push(struct cache *c, uint32_t i)
+{
+	c->entry[i].prev = NIL;
+	c->entry[i].next = c->head;
+	if (c->head != NIL) {
+		c->entry[c->head].prev = i;
+	} else {
+		c->tail = i;
+	}
+	c->head = i;
+}
+
+static uint32_t *
+find(struct cache *c, uint64_t h, const char *key, size_t keylen)
+{
+	uint32_t *i;
+
+	/* return the link pointing to the entry, to be able to unlink it */
+	for (i = &c->bucket[h % c->nentries]; *i != NIL;
+	     i = &c->entry[*i].hnext) {
+		if (c->entry[*i].hash == h && c->entry[*i].keylen == keylen &&
+		    !chain_cmp(c, c->entry[*i].block, key, keylen)) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+static void
+evict(struct cache *c, uint32_t *link)
+{
+	uint32_t i = *link, b, last;
+
+	/* unlink from bucket and LRU list */
+	*link = c->entry[i].hnext;
+	lru_unlink(c, i);
+
+	/* return the block chain and the entry to the free lists */
+	for (b = last = c->entry[i].block; b != NIL; b = c->bnext[b]) {
+		last = b;
+		c->nfreeblocks++;
+	}
+	c->bnext[last] = c->freeblock;
+	c->freeblock = c->entry[i].block;
+	c->entry[i].hnext = c->freeentry;
+	c->freeentry = i;
+}
+
+int
+cache_get(struct cache *c, const char *key, size_t keylen, char **val,
+          size_t *len)
+{
+	uint32_t *link, i;
+	int ret = 1;
+
+	if (c == NULL || lock(c)) {
+		return 1;
+	}
+	if (*(link = find(c, hash(key, keylen), key, keylen)) != NIL) {
+		i = *link;
+		if ((*val = malloc(MAX(c->entry[i].len, 1)))) {
+			chain_copy(c, c->entry[i].block, keylen, *val, NULL,
+			           c->entry[i].len);
+			*len = c->entry[i].len;
+
+			/* mark as most recently used */
+			lru_unlink(c, i);
+			lru_push(c, i);
+			ret = 0;
+		}
+	}
+	unlock(c);
+
+	return ret;
+}
+
+void
+cache_put(struct cache *c, const char *key, size_t keylen,
+          const struct iovec *iov, int iovcnt)
+{
+	uint64_t h;
+	uint32_t *link, i, b, n, need;
+	size_t len, off;
+	int j;
+
+	/* the value is gathered from iovcnt pieces */
+	for (len = 0, j = 0; j < iovcnt; j++) {
+		len += iov[j].iov_len;
+	}
+
+	/* don't let a single entry take over more than a quarter */
+	if (c == NULL || (keylen + len) / BLOCK_SIZE >= c->nblocks / 4) {
+		return;
+	}
+	h = hash(key, keylen);
+	need = (keylen + len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	if (lock(c)) {
+		return;
+	}
+
+	/* drop the old value and make room for the new one */
+	if (*(link = find(c, h, key, keylen)) != NIL) {
+		evict(c, link);
+	}
+	while (c->freeentry == NIL || c->nfreeblocks < need) {
+		i = c->tail;
+		for (link = &c->bucket[c->entry[i].hash % c->nentries];
+		     *link != i; link = &c->entry[*link].hnext)
+			;
+		evict(c, link);
+	}
+
+	/* take the entry and the block chain from the free lists */
+	i = c->freeentry;
+	c->freeentry = c->entry[i].hnext;
+	c->entry[i].block = b = c->freeblock;
+	for (n = 1; n < need; n++) {
+		b = c->bnext[b];
+	}
+	c->freeblock = c->bnext[b];
+	c->bnext[b] = NIL;
+	c->nfreeblocks -= need;
+
+	c->entry[i].hash = h;
+	c->entry[i].keylen = keylen;
+	c->entry[i].len = len;
+	chain_copy(c, c->entry[i].block, 0, NULL, key, keylen);
+	for (off = keylen, j = 0; j < iovcnt; off += iov[j].iov_len, j++) {
+		chain_copy(c, c->entry[i].block, off, NULL, iov[j].iov_base,
+		           iov[j].iov_len);
+	}
+
+	/* insert into bucket and LRU list */
+	link = &c->bucket[h % c->nentries];
+	c->entry[i].hnext = *link;
+	*link = i;
+	lru_push(c, i);
+
+	unlock(c);
+}
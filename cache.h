@@ -0,0 +1,20 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*
+ * A key-value store for opaque blobs in a shared memory region. It is
+ * created before the workers are forked, so they all share it, and
+ * evicts the least recently used entries when it runs out of space.
+ */
+struct cache;
+
+struct cache *cache_create(size_t, size_t);
+int cache_get(struct cache *, const char *, size_t, char **, size_t *);
+void cache_put(struct cache *, const char *, size_t, const struct iovec *,
+               int);
+
+#endif /* CACHE_H */
@@ -1,6 +1,89 @@
 #define HEADER_MAX 4096
 #define FIELD_MAX  200
 
+/* status lines with Connection and Content-Type each worker keeps */
+#define HEADER_PREFIXES 64
+
+/* seconds of inactivity after which a connection is dropped */
+#define TIMEOUT 30
+
+/* persistent connections: idle seconds between requests, max requests */
+#define KEEPALIVE_TIMEOUT 5
+#define KEEPALIVE_MAX     100
+
+/*
+ * a worker dying within a second of its start is respawned after a
+ * delay doubling each time, up to the maximum in seconds, until it has
+ * done so this often in a row
+ */
+#define RESPAWN_RETRIES  8
+#define RESPAWN_MAXDELAY 60
+
+/*
+ * rendered listings and compressed bodies shared by all workers: bytes,
+ * number of entries (0 disables the cache) and the seconds of each
+ * generation of listings: they are re-rendered in the next one even if
+ * the directory is unchanged, to pick up new file sizes, and so change
+ * their validators if they show sizes or modification times
+ */
+#define CACHE_SIZE     (32 << 20)
+#define CACHE_ENTRIES  1024
+#define LISTING_MAXAGE 10
+
+/*
+ * paths whose lookup each worker remembers, keeping hot files open, and
+ * seconds a lookup is trusted before the path is checked again
+ */
+#define FDCACHE_ENTRIES 256
+#define FDCACHE_VALID   1
+
+/*
+ * access log: bytes of the ring in which all processes hand their lines
+ * to the log writer (0 has each write its lines itself), milliseconds
+ * the writer sleeps between draining it, seconds between checking
+ * whether the log file was rotated (SIGHUP checks at once), and 1 in
+ * how many lines are kept while the ring is more than half full
+ * (errors are always kept)
+ */
+#define LOG_RING     (1 << 20)
+#define LOG_INTERVAL 100
+#define LOG_REOPEN   60
+#define LOG_SAMPLE   10
+
+/* hosts whose vhost, if found by regex, each worker remembers */
+#define VHOST_MEMO 256
+
+/* directories whose template lookup and templates each worker remembers */
+#define TEMPLCACHE_DIRS 256
+
+/*
+ * small files sent from memory, shared by all workers: largest file,
+ * bytes and number of entries (0 disables the cache)
+ */
+#define FILECACHE_MAX     (64 << 10)
+#define FILECACHE_SIZE    (16 << 20)
+#define FILECACHE_ENTRIES 1024
+
+/* compression level and largest file compressed on the fly */
+#define GZIP_LEVEL 6
+#define GZIP_MAX   (4 << 20)
+
+/* leave "x.gz" out of listings when "x" is next to it */
+#define GZIP_HIDE_SIDECARS 1
+
+/* mime-type prefixes worth compressing */
+static const char *const gzip_types[] = {
+	"text/",
+	"application/xml",
+	"application/xhtml+xml",
+	"application/json",
+	"application/javascript",
+	"image/svg+xml",
+};
+
+/* mime-types, read at startup; the table below takes precedence */
+#define MIMETYPES "/etc/mime.types"
+
 /* mime-types */
 static const struct {
 	char *ext;
@@ -15,7 +98,8 @@ static const struct {
 	{ "md",    "text/plain; charset=utf-8" },
 	{ "c",     "text/plain; charset=utf-8" },
 	{ "h",     "text/plain; charset=utf-8" },
-	{ "gz",    "application/x-gtar" },
+	{ "gz",    "application/gzip" },
+	{ "tar.gz", "application/x-gtar" },
 	{ "tar",   "application/tar" },
 	{ "pdf",   "application/x-pdf" },
 	{ "png",   "image/png" },
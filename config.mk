@@ -10,7 +10,7 @@ MANPREFIX = $(PREFIX)/share/man
 # flags
 CPPFLAGS = -DVERSION=\"$(VERSION)\" -D_DEFAULT_SOURCE -D_XOPEN_SOURCE=700 -D_BSD_SOURCE
 CFLAGS   = -std=c99 -pedantic -Wall -Wextra -Os $(STATIC)
-LDFLAGS  = -s
+LDFLAGS  = -s -lpthread -lz
 
 # compiler and linker
 CC = cc
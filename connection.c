@@ -0,0 +1,262 @@
+/* See LICENSE file for copyright and license details. */
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "connection.h"
+#include "data.h"
+#include "http.h"
+#include "logger.h"
+#include "sock.h"
+#include "stats.h"
+#include "util.h"
+
+struct connection *
+connection_accept(int insock, struct connection *connection, size_t nslots)
+{
+	struct connection *c = NULL;
+	struct sockaddr_storage ia;
+	size_t i;
+	int fd;
+
+	/*
+	 * accept first, another worker may have taken the connection,
+	 * and nobody should make room for one that isn't there
+	 */
+	if ((fd = accept(insock, (struct sockaddr *)&ia,
+	                 &(socklen_t){sizeof(ia)})) < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			/*
+			 * this should not happen, as we received the
+			 * event that there are pending connections here
+			 */
+			warn("accept:");
+		}
+		return NULL;
+	}
+
+	/* set socket to non-blocking mode */
+	if (sock_set_nonblocking(fd)) {
+		close(fd);
+		return NULL;
+	}
+
+	/* find vacant connection */
+	for (i = 0; i < nslots; i++) {
+		if (connection[i].state == C_VACANT) {
+			c = &connection[i];
+			break;
+		}
+	}
+	if (c == NULL) {
+		/*
+		 * all slots are taken; sacrifice the connection that
+		 * has been waiting for its request header the longest,
+		 * as it is most likely a slow or malicious client
+		 */
+		for (i = 0; i < nslots; i++) {
+			if (connection[i].state == C_RECV_HEADER &&
+			    (c == NULL || connection[i].last < c->last)) {
+				c = &connection[i];
+			}
+		}
+		if (c == NULL) {
+			/* no candidate, turn the new client away */
+			close(fd);
+			return NULL;
+		}
+
+		/*
+		 * only a request cut short is logged, a client that has
+		 * sent nothing yet can simply reconnect
+		 */
+		if (c->hlen > 0) {
+			connection_drop(c, S_REQUEST_TIMEOUT);
+		} else {
+			connection_reset(c);
+		}
+	}
+
+	c->fd = fd;
+	c->ia = ia;
+	c->state = C_RECV_HEADER;
+	c->last = time(NULL);
+	stats_connection(1);
+
+	return c;
+}
+
+void
+connection_reset(struct connection *c)
+{
+	if (c != NULL) {
+		shutdown(c->fd, SHUT_RD);
+		shutdown(c->fd, SHUT_WR);
+		close(c->fd);
+		data_release(&c->res);
+		memset(c, 0, sizeof(*c));
+		stats_connection(-1);
+	}
+}
+
+void
+connection_drop(struct connection *c, enum status s)
+{
+	c->res.status = s;
+	logger_log(c);
+	stats_request(c);
+	connection_reset(c);
+}
+
+static int
+connection_idle(const struct connection *c)
+{
+	/* waiting between two requests on a persistent connection */
+	return c->state == C_RECV_HEADER && c->nreq > 0 && c->hlen == 0;
+}
+
+time_t
+connection_deadline(const struct connection *c)
+{
+	return c->last + (connection_idle(c) ? KEEPALIVE_TIMEOUT : TIMEOUT);
+}
+
+void
+connection_timeout(struct connection *c)
+{
+	if (connection_idle(c)) {
+		/* nothing is lost, the client can simply reconnect */
+		connection_reset(c);
+	} else {
+		connection_drop(c, S_REQUEST_TIMEOUT);
+	}
+}
+
+static void
+connection_next(struct connection *c)
+{
+	/* keep the socket and any pipelined data for the next request */
+	data_release(&c->res);
+	memset(&c->parser, 0, sizeof(c->parser));
+	memset(&c->req, 0, sizeof(c->req));
+	memset(&c->res, 0, sizeof(c->res));
+	c->buf.len = 0;
+	c->buf.sent = 0;
+	c->head = 0;
+	c->start.tv_sec = 0;
+	c->off = 0;
+	c->nreq++;
+	c->state = C_RECV_HEADER;
+}
+
+void
+connection_serve(struct connection *c, const struct server *srv)
+{
+	enum status s;
+	size_t len;
+	int done;
+
+	c->last = time(NULL);
+next:
+	switch (c->state) {
+	case C_VACANT:
+		/* we were passed a "fresh" connection */
+		c->state = C_RECV_HEADER;
+		/* fallthrough */
+	case C_RECV_HEADER:
+		/*
+		 * parse what has arrived, which might already be a pipelined
+		 * request, and only then read more
+		 */
+		while (!(s = http_parse_header(&c->parser, c->header, c->hlen,
+		                               &c->req)) && !c->parser.done) {
+			len = c->hlen;
+			if ((s = http_recv_header(c->fd, c->header,
+			                          LEN(c->header), &c->hlen))) {
+				if (connection_idle(c)) {
+					/* the client closed the connection */
+					connection_reset(c);
+					return;
+				}
+				break;
+			}
+			if (c->hlen == len) {
+				/* not done yet, wait for more data */
+				return;
+			}
+		}
+		clock_gettime(CLOCK_REALTIME, &c->start);
+		if (s) {
+			http_prepare_error_response(&c->req, &c->res, s);
+			goto response;
+		}
+
+		/* prepare the response */
+		http_prepare_response(&c->req, &c->res, srv);
+		c->res.keepalive = (c->nreq + 1 < KEEPALIVE_MAX) &&
+		                   http_keepalive(&c->req, &c->res);
+
+		/* move pipelined data to the front of the buffer */
+		memmove(c->header, c->header + c->parser.off,
+		        c->hlen - c->parser.off);
+		c->hlen -= c->parser.off;
+response:
+		/* generate response header */
+		if ((s = http_prepare_header_buf(&c->res, &c->buf))) {
+			http_prepare_error_response(&c->req, &c->res, s);
+			if ((s = http_prepare_header_buf(&c->res, &c->buf))) {
+				/* couldn't generate the header, we failed */
+				c->res.status = s;
+				goto done;
+			}
+		}
+		c->head = c->buf.len;
+
+		c->state = C_SEND_HEADER;
+		/* fallthrough */
+	case C_SEND_HEADER:
+		if (http_has_body(&c->req, &c->res)) {
+			/* the body is sent along with the header */
+			c->state = C_SEND_BODY;
+			goto next;
+		}
+		if ((s = http_send_buf(c->fd, &c->buf, NULL, 0, NULL, 0))) {
+			c->res.status = s;
+			c->res.keepalive = 0;
+			goto done;
+		}
+		if (c->buf.len > 0) {
+			/* not done yet, wait for the socket to drain */
+			return;
+		}
+		break;
+	case C_SEND_BODY:
+		if ((s = data_fct[c->res.type](c->fd, &c->res, &c->buf,
+		                               &c->off, &done))) {
+			/* too late to do any real error handling */
+			c->res.status = s;
+			c->res.keepalive = 0;
+			goto done;
+		}
+		if (!done) {
+			/* not done yet, wait for the socket to drain */
+			return;
+		}
+		break;
+	default:
+		warn("serve: invalid connection state");
+		return;
+	}
+done:
+	logger_log(c);
+	stats_request(c);
+	if (c->res.keepalive) {
+		/* serve the next request, which might already be here */
+		connection_next(c);
+		goto next;
+	}
+	connection_reset(c);
+}
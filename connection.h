@@ -0,0 +1,43 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <sys/socket.h>
+#include <time.h>
+
+#include "http.h"
+#include "util.h"
+
+enum conn_state {
+	C_VACANT,
+	C_RECV_HEADER,
+	C_SEND_HEADER,
+	C_SEND_BODY,
+	NUM_CONN_STATES,
+};
+
+struct connection {
+	enum conn_state state;
+	int fd;
+	struct sockaddr_storage ia;
+	char header[HEADER_MAX]; /* request-header buffer */
+	size_t hlen;             /* length of the received data in header */
+	struct parser parser;    /* progress in parsing the header */
+	size_t off;              /* general offset (file/dir) */
+	size_t nreq;             /* number of requests served */
+	time_t last;             /* time of last activity */
+	struct timespec start;   /* when the request header was complete */
+	struct request req;
+	struct response res;
+	struct buffer buf;       /* outgoing response-header/body buffer */
+	size_t head;             /* length of the response header in buf */
+};
+
+struct connection *connection_accept(int, struct connection *, size_t);
+void connection_reset(struct connection *);
+void connection_drop(struct connection *, enum status);
+time_t connection_deadline(const struct connection *);
+void connection_timeout(struct connection *);
+void connection_serve(struct connection *, const struct server *);
+
+#endif /* CONNECTION_H */
@@ -1,141 +1,1040 @@
 /* See LICENSE file for copyright and license details. */
+#define _GNU_SOURCE /* splice() */
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
-#include "http.h"
+#include "cache.h"
+#include "config.h"
 #include "data.h"
-#include "util.h"
 #include "dirl.h"
+#include "fdcache.h"
+#include "gzip.h"
+#include "http.h"
+#include "stats.h"
+#include "util.h"
+
+enum status (* const data_fct[])(int, struct response *, struct buffer *,
+                                 size_t *, int *) = {
+	[RESTYPE_ERROR]      = data_send_error,
+	[RESTYPE_FILE]       = data_send_file,
+	[RESTYPE_DIRLISTING] = data_send_dirlisting,
+};
+
+/* maximum number of file bytes handed to the kernel at once */
+#define FILE_CHUNK (1 << 20)
+
+/* listing bytes rendered at once when streaming a directory */
+#define STREAM_CHUNK (64 << 10)
+
+/* multipart/byteranges framing around each part, and at the end */
+#define PART_HEADER "\r\n--%s\r\nContent-Type: %s\r\n" \
+                    "Content-Range: bytes %zu-%zu/%zu\r\n\r\n"
+#define PART_END    "\r\n--%s--\r\n"
+
+#define ERROR_PAGE "<!DOCTYPE html>\n<html>\n\t<head>\n" \
+                   "\t\t<title>%d %s</title>\n\t</head>\n" \
+                   "\t<body>\n\t\t<h1>%d %s</h1>\n" \
+                   "\t</body>\n</html>\n"
+
+/*
+ * A cached listing is stored as its metadata, followed by the
+ * template directory (if any) and the rendered body. It is valid as
+ * long as the same template directory is found for it, and the
+ * directory and the templates are the same files with the same
+ * modification time as when it was rendered, within the generation
+ * it was rendered in.
+ */
+struct listing_meta {
+	time_t rendered;
+	struct fileid id[4]; /* directory, header, entry, footer */
+	size_t templdirlen;
+};
+
+/*
+ * the directory and the templates found for it, whose files were
+ * checked when they were looked up; missing files are all zero, so
+ * they compare equal
+ */
+static void
+listing_ids(const char *path, const struct dirl_templ *templates,
+            struct fileid id[4])
+{
+	struct stat st;
+
+	memset(&id[0], 0, sizeof(id[0]));
+	if (!fdcache_stat(path, &st)) {
+		fileid_set(&id[0], &st);
+	}
+	memcpy(id + 1, templates->id, sizeof(templates->id));
+}
+
+/*
+ * Entries changing in place don't change the directory, so listings
+ * showing their sizes or modification times are only valid within a
+ * generation of LISTING_MAXAGE seconds and rendered anew in the next.
+ */
+static int
+listing_aging(const struct dirl_templ *templates)
+{
+	return templates->entry_prog.ops & ((1 << DIRL_OP_SIZE) |
+	                                    (1 << DIRL_OP_MODIFIED));
+}
+
+static time_t
+listing_generation(time_t t)
+{
+	return t / MAX(LISTING_MAXAGE, 1);
+}
+
+static size_t
+listing_key(const struct response *res, char *key, size_t keysiz)
+{
+	size_t pathlen, urilen;
+
+	/* the path includes the vhost, the uri ends up in the body */
+	pathlen = strlen(res->path);
+	urilen = strlen(res->uri);
+	if (pathlen + 1 + urilen > keysiz) {
+		return 0;
+	}
+	memcpy(key, res->path, pathlen + 1);
+	memcpy(key + pathlen + 1, res->uri, urilen);
+
+	return pathlen + 1 + urilen;
+}
+
+/*
+ * A listing is revalidated by its directory and the templates it is
+ * rendered with, without reading any entries, and by its generation
+ * if it shows what entries changing in place would change. The body
+ * may differ within that, so only a weak tag can be built from it.
+ */
+int
+data_listing_validator(const struct response *res, uint64_t *v,
+                       time_t *mtime)
+{
+	const struct dirl_templ *templates;
+	struct fileid id[4];
+	struct stat st;
+	struct timespec ctim;
+	time_t gen = 0;
+	size_t i;
+
+	if (fdcache_stat(res->path, &st) < 0 ||
+	    !(templates = dirl_get_templ(res->uri))) {
+		return 1;
+	}
+	listing_ids(res->path, templates, id);
+	ctim = st.st_ctim;
+	if (listing_aging(templates)) {
+		gen = listing_generation(time(NULL));
+	}
+
+	/* FNV-1a over the identities, the directory's ctime and gen */
+	*v = 0xcbf29ce484222325;
+	for (i = 0; i < sizeof(id); i++) {
+		*v = (*v ^ ((unsigned char *)id)[i]) * 0x100000001b3;
+	}
+	for (i = 0; i < sizeof(ctim); i++) {
+		*v = (*v ^ ((unsigned char *)&ctim)[i]) * 0x100000001b3;
+	}
+	for (i = 0; i < sizeof(gen); i++) {
+		*v = (*v ^ ((unsigned char *)&gen)[i]) * 0x100000001b3;
+	}
+
+	/* a new generation counts as a modification */
+	*mtime = MAX(st.st_mtim.tv_sec, st.st_ctim.tv_sec);
+	for (i = 1; i < 4; i++) {
+		*mtime = MAX(*mtime, id[i].mtim.tv_sec);
+	}
+	*mtime = MAX(*mtime, gen * MAX(LISTING_MAXAGE, 1));
+
+	return 0;
+}
 
 static int
-compareent(const struct dirent **d1, const struct dirent **d2)
+listing_get(struct cache *cache, const char *key, size_t keylen,
+            struct response *res, struct listing_meta *metap, char *templdirp)
+{
+	const struct dirl_templ *templates;
+	struct listing_meta meta;
+	struct fileid id[4];
+	size_t len, off;
+	char *blob, *templdir;
+
+	if (cache_get(cache, key, keylen, &blob, &len)) {
+		stats_cache(STATS_LISTING, 0);
+		return 1;
+	}
+	memcpy(&meta, blob, sizeof(meta));
+	off = sizeof(meta) + meta.templdirlen;
+	templdir = meta.templdirlen ? blob + sizeof(meta) : NULL;
+
+	/* templates may have appeared or vanished in an ancestor */
+	if (!(templates = dirl_get_templ(res->uri)) ||
+	    (templates->dir ? (!templdir || strcmp(templdir, templates->dir))
+	                    : templdir != NULL)) {
+		free(blob);
+		stats_cache(STATS_LISTING, 0);
+		return 1;
+	}
+
+	listing_ids(res->path, templates, id);
+	if (listing_generation(time(NULL)) !=
+	    listing_generation(meta.rendered) ||
+	    memcmp(id, meta.id, sizeof(id))) {
+		free(blob);
+		stats_cache(STATS_LISTING, 0);
+		return 1;
+	}
+	stats_cache(STATS_LISTING, 1);
+
+	/* hand out what is needed to cache another encoding of it */
+	if (metap) {
+		*metap = meta;
+		memcpy(templdirp, templdir ? templdir : "",
+		       templdir ? meta.templdirlen : 1);
+	}
+
+	memmove(blob, blob + off, len - off);
+	res->body.data = blob;
+	res->body.len = len - off;
+
+	return 0;
+}
+
+static void
+listing_put(struct cache *cache, const char *key, size_t keylen,
+            const struct response *res, struct listing_meta *meta,
+            const char *templdir)
 {
+	struct iovec iov[3];
+
+	meta->templdirlen = templdir[0] ? strlen(templdir) + 1 : 0;
+	iov[0].iov_base = meta;
+	iov[0].iov_len = sizeof(*meta);
+	iov[1].iov_base = (char *)templdir;
+	iov[1].iov_len = meta->templdirlen;
+	iov[2].iov_base = res->body.data;
+	iov[2].iov_len = res->body.len;
+
+	cache_put(cache, key, keylen, iov, 3);
+}
+
+static int
+compareent(const void *p1, const void *p2)
+{
+	const struct dirent *d1 = *(const struct dirent **)p1;
+	const struct dirent *d2 = *(const struct dirent **)p2;
 	int v;
 
-	v = ((*d2)->d_type == DT_DIR ? 1 : -1) -
-	    ((*d1)->d_type == DT_DIR ? 1 : -1);
+	v = (d2->d_type == DT_DIR ? 1 : -1) - (d1->d_type == DT_DIR ? 1 : -1);
 	if (v) {
 		return v;
 	}
 
-	return strcmp((*d1)->d_name, (*d2)->d_name);
+	return strcmp(d1->d_name, d2->d_name);
 }
 
-enum status
-data_send_dirlisting(int fd, const struct response *res)
+/*
+ * read the entries of the directory dirfd refers to, sorted, through a
+ * duplicate of it so dirfd stays open; it returns their number or -1
+ */
+static int
+read_entries(int dirfd, struct dirent ***list)
+{
+	struct dirent *e, **l = NULL, **t;
+	DIR *dir;
+	size_t n = 0, cap = 0, siz;
+	int fd;
+
+	if ((fd = dup(dirfd)) < 0) {
+		return -1;
+	}
+	if (!(dir = fdopendir(fd))) {
+		close(fd);
+		return -1;
+	}
+
+	/* readdir() reuses its entry, each one is copied out */
+	for (errno = 0; (e = readdir(dir)); errno = 0) {
+		if (n == cap) {
+			cap = cap ? 2 * cap : 64;
+			if (!(t = reallocarray(l, cap, sizeof(*l)))) {
+				goto err;
+			}
+			l = t;
+		}
+		siz = offsetof(struct dirent, d_name) + strlen(e->d_name) + 1;
+		if (!(l[n] = malloc(MAX(siz, sizeof(*e))))) {
+			goto err;
+		}
+		memcpy(l[n++], e, siz);
+	}
+	if (errno) {
+		goto err;
+	}
+	closedir(dir);
+
+	qsort(l, n, sizeof(*l), compareent);
+	*list = l;
+
+	return n;
+err:
+	while (n--) {
+		free(l[n]);
+	}
+	free(l);
+	closedir(dir);
+
+	return -1;
+}
+
+static enum status
+render_dirlisting(struct response *res, struct listing_meta *meta,
+                  char *templdir)
 {
 	enum status ret = 0;
 	struct dirent **e;
+	const struct dirl_templ *templates = NULL;
+	struct stat st;
+	FILE *fp;
 	size_t i;
-	int dirlen;
+	int dirfd, dirlen;
+
+	/*
+	 * take the timestamp before reading the directory, so changes
+	 * made while rendering invalidate the cached listing
+	 */
+	memset(meta, 0, sizeof(*meta));
+	meta->rendered = time(NULL);
+	if (!fdcache_stat(res->path, &st)) {
+		fileid_set(&meta->id[0], &st);
+	}
 
 	/* read directory */
-	if ((dirlen = scandir(res->path, &e, NULL, compareent)) < 0) {
+	/* keep it open, the entries are looked up relative to it */
+	if ((dirfd = open(res->path, O_RDONLY | O_DIRECTORY)) < 0) {
+		return S_FORBIDDEN;
+	}
+	if ((dirlen = read_entries(dirfd, &e)) < 0) {
+		close(dirfd);
 		return S_FORBIDDEN;
 	}
 
-  /* read templates */
-  struct dirl_templ templates = dirl_read_templ(res->uri);
+	/* render into memory, the body is sent as the socket drains */
+	res->body.data = NULL;
+	res->body.len = 0;
+	if (!(fp = open_memstream(&res->body.data,
+	                          &res->body.len))) {
+		ret = S_INTERNAL_SERVER_ERROR;
+		goto cleanup;
+	}
+
+	/* get templates */
+	if (!(templates = dirl_get_templ(res->uri))) {
+		ret = S_INTERNAL_SERVER_ERROR;
+		goto cleanup;
+	}
 
-  /* listing header */
-  if ((ret = dirl_header(fd, res, &templates))) {
-    return ret;
-  }
+	/* listing header */
+	if ((ret = dirl_header(fp, res, templates))) {
+		goto cleanup;
+	}
 
 	/* entries */
 	for (i = 0; i < (size_t)dirlen; i++) {
-    /*  skip dirl special files */
-    if(dirl_skip(e[i]->d_name)) {
-      continue;
-    }
-
-    /* entry line */
-    if ((ret = dirl_entry(fd, e[i], res, &templates))) {
-      goto cleanup;
-    }
+		/* skip dirl special files */
+		if (dirl_skip(dirfd, e[i]->d_name)) {
+			continue;
+		}
 
+		/* entry line */
+		if ((ret = dirl_entry(fp, dirfd, e[i], templates))) {
+			goto cleanup;
+		}
 	}
 
-  /* listing footer */
-  if ((ret = dirl_footer(fd, &templates))) {
-    goto cleanup;
-  }
-
+	/* listing footer */
+	ret = dirl_footer(fp, templates);
 cleanup:
+	if (fp) {
+		if (fclose(fp) && !ret) {
+			ret = S_INTERNAL_SERVER_ERROR;
+		}
+		if (!ret) {
+			memcpy(meta->id + 1, templates->id,
+			       sizeof(templates->id));
+			if (esnprintf(templdir, PATH_MAX, "%s", templates->dir ?
+			              templates->dir : "")) {
+				ret = S_INTERNAL_SERVER_ERROR;
+			}
+		}
+	}
 	while (dirlen--) {
 		free(e[dirlen]);
 	}
 	free(e);
+	close(dirfd);
+
+	if (ret) {
+		free(res->body.data);
+		res->body.data = NULL;
+		res->body.len = 0;
+	}
 
 	return ret;
 }
 
 enum status
-data_send_error(int fd, const struct response *res)
+data_render_dirlisting(struct response *res, struct cache *cache,
+                       enum encoding *enc)
+{
+	enum status ret;
+	struct listing_meta meta;
+	struct timespec start;
+	size_t keylen = 0, enckeylen = 0, zlen;
+	char key[2 * PATH_MAX], enckey[2 * PATH_MAX + 16];
+	char templdir[PATH_MAX], *z;
+
+	if (cache) {
+		keylen = listing_key(res, key, sizeof(key));
+	}
+
+	/* the encoded variant is cached under its own key */
+	if (keylen && *enc != ENC_IDENTITY) {
+		memcpy(enckey, key, keylen);
+		enckey[keylen] = '\0';
+		enckeylen = keylen + 1 + strlen(encoding_str[*enc]);
+		memcpy(enckey + keylen + 1, encoding_str[*enc],
+		       strlen(encoding_str[*enc]));
+		if (!listing_get(cache, enckey, enckeylen, res, NULL, NULL)) {
+			return 0;
+		}
+	}
+
+	/* serve a listing rendered before if it is still valid */
+	if (!keylen || listing_get(cache, key, keylen, res, &meta, templdir)) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if ((ret = render_dirlisting(res, &meta, templdir))) {
+			return ret;
+		}
+		stats_render(&start);
+		if (keylen) {
+			listing_put(cache, key, keylen, res, &meta, templdir);
+		}
+	}
+
+	if (*enc != ENC_IDENTITY) {
+		if (gzip_compress(*enc, res->body.data, res->body.len,
+		                  &z, &zlen)) {
+			/* send it as it is */
+			*enc = ENC_IDENTITY;
+			return 0;
+		}
+		free(res->body.data);
+		res->body.data = z;
+		res->body.len = zlen;
+		if (enckeylen) {
+			listing_put(cache, enckey, enckeylen, res, &meta,
+			            templdir);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * A file body is cached along with the identity of the file it was
+ * made from: compressed ones under their encoding and path, small
+ * ones as they are under their path. Files that don't compress are
+ * remembered as well, with an empty body.
+ */
+struct file_meta {
+	struct fileid id;
+	off_t size;
+	int stored;
+};
+
+static void
+file_meta_set(struct file_meta *meta, const struct stat *st)
+{
+	memset(meta, 0, sizeof(*meta));
+	fileid_set(&meta->id, st);
+	meta->size = st->st_size;
+}
+
+/* 0 if the body was found, -1 if it is known not to be stored */
+static int
+file_get(struct cache *cache, const char *key, size_t keylen,
+         const struct file_meta *meta, struct response *res)
+{
+	struct file_meta *cached;
+	size_t len;
+	char *blob;
+
+	if (cache_get(cache, key, keylen, &blob, &len)) {
+		return 1;
+	}
+	cached = (struct file_meta *)blob;
+	if (len < sizeof(*meta) || memcmp(cached, meta,
+	    offsetof(struct file_meta, stored))) {
+		free(blob);
+		return 1;
+	}
+	if (!cached->stored) {
+		free(blob);
+		return -1;
+	}
+	memmove(blob, blob + sizeof(*meta), len - sizeof(*meta));
+	res->body.data = blob;
+	res->body.len = len - sizeof(*meta);
+
+	return 0;
+}
+
+static void
+file_put(struct cache *cache, const char *key, size_t keylen,
+         const struct file_meta *meta, const char *data, size_t len)
+{
+	struct iovec iov[2];
+
+	iov[0].iov_base = (struct file_meta *)meta;
+	iov[0].iov_len = sizeof(*meta);
+	iov[1].iov_base = (char *)data;
+	iov[1].iov_len = meta->stored ? len : 0;
+	cache_put(cache, key, keylen, iov, 2);
+}
+
+/* read the whole file, from the descriptor kept for it if there is one */
+static char *
+file_read(const struct response *res, const struct stat *st)
+{
+	ssize_t r;
+	size_t len;
+	char *data;
+	int fd;
+
+	if ((fd = res->file.fd) < 0 && (fd = open(res->path, O_RDONLY)) < 0) {
+		return NULL;
+	}
+	if ((data = malloc(MAX(st->st_size, 1)))) {
+		for (len = 0; len < (size_t)st->st_size; len += r) {
+			if ((r = pread(fd, data + len, st->st_size - len,
+			               len)) <= 0) {
+				/* error or file was truncated underneath us */
+				free(data);
+				data = NULL;
+				break;
+			}
+		}
+	}
+	if (fd != res->file.fd) {
+		close(fd);
+	}
+
+	return data;
+}
+
+int
+data_compress_file(struct response *res, const struct stat *st,
+                   struct cache *cache, enum encoding enc)
+{
+	struct file_meta meta;
+	size_t keylen = 0, zlen = 0;
+	char key[PATH_MAX + 16], *data, *z = NULL;
+	int r;
+
+	file_meta_set(&meta, st);
+	if (cache && !esnprintf(key, sizeof(key), "%s", encoding_str[enc])) {
+		keylen = strlen(key) + 1;
+		if (esnprintf(key + keylen, sizeof(key) - keylen, "%s",
+		              res->path)) {
+			keylen = 0;
+		} else {
+			keylen += strlen(res->path);
+		}
+	}
+	if (keylen) {
+		/* knowing that it doesn't compress is a hit as well */
+		r = file_get(cache, key, keylen, &meta, res);
+		stats_cache(STATS_GZIP, r <= 0);
+		if (r <= 0) {
+			return r ? 1 : 0;
+		}
+	}
+
+	/* it is bounded by GZIP_MAX */
+	if (!(data = file_read(res, st))) {
+		return 1;
+	}
+	meta.stored = !gzip_compress(enc, data, st->st_size, &z, &zlen);
+	free(data);
+
+	if (keylen) {
+		file_put(cache, key, keylen, &meta, z, zlen);
+	}
+	if (!meta.stored) {
+		return 1;
+	}
+	res->body.data = z;
+	res->body.len = zlen;
+
+	return 0;
+}
+
+int
+data_load_file(struct response *res, const struct stat *st,
+               struct cache *cache)
 {
-	if (dprintf(fd,
-	            "<!DOCTYPE html>\n<html>\n\t<head>\n"
-	            "\t\t<title>%d %s</title>\n\t</head>\n\t<body>\n"
-	            "\t\t<h1>%d %s</h1>\n\t</body>\n</html>\n",
-	            res->status, status_str[res->status],
-		    res->status, status_str[res->status]) < 0) {
-		return S_REQUEST_TIMEOUT;
+	struct file_meta meta;
+	char *data;
+
+	file_meta_set(&meta, st);
+	if (!file_get(cache, res->path, strlen(res->path), &meta, res)) {
+		stats_cache(STATS_FILE, 1);
+		return 0;
 	}
+	stats_cache(STATS_FILE, 0);
+	if (!(data = file_read(res, st))) {
+		return 1;
+	}
+	meta.stored = 1;
+	file_put(cache, res->path, strlen(res->path), &meta, data,
+	         st->st_size);
+	res->body.data = data;
+	res->body.len = st->st_size;
 
 	return 0;
 }
 
+static enum status
+send_body(int fd, struct response *res, struct buffer *buf,
+          size_t *progress, int *done)
+{
+	enum status s;
+
+	/* the body goes out right behind the header */
+	s = http_send_buf(fd, buf, res->body.data, res->body.len, progress, 0);
+	*done = !s && buf->len == 0 && *progress == res->body.len;
+
+	return s;
+}
+
 enum status
-data_send_file(int fd, const struct response *res)
+data_open_dirstream(struct response *res, int chunked)
+{
+	if (!(res->dirlisting.dir = opendir(res->path))) {
+		return S_FORBIDDEN;
+	}
+	res->dirlisting.chunked = chunked;
+
+	return 0;
+}
+
+static enum status
+render_dirstream_chunk(struct response *res, struct buffer *buf)
 {
-	FILE *fp;
 	enum status ret = 0;
-	ssize_t bread, bwritten;
-	size_t remaining;
-	static char buf[BUFSIZ], *p;
+	const struct dirl_templ *templates;
+	struct dirent *e;
+	FILE *fp;
+	off_t len = 0;
 
-	/* open file */
-	if (!(fp = fopen(res->path, "r"))) {
-		ret = S_FORBIDDEN;
-		goto cleanup;
+	free(res->body.data);
+	res->body.data = NULL;
+	res->body.len = 0;
+	if (!(fp = open_memstream(&res->body.data,
+	                          &res->body.len))) {
+		return S_INTERNAL_SERVER_ERROR;
 	}
 
-	/* seek to lower bound */
-	if (fseek(fp, res->file.lower, SEEK_SET)) {
+	/*
+	 * get the templates for every chunk, other listings rendered
+	 * in between may have replaced the cached ones
+	 */
+	if (!(templates = dirl_get_templ(res->uri))) {
 		ret = S_INTERNAL_SERVER_ERROR;
 		goto cleanup;
 	}
-
-	/* write data until upper bound is hit */
-	remaining = res->file.upper - res->file.lower + 1;
-
-	while ((bread = fread(buf, 1, MIN(sizeof(buf),
-	                      remaining), fp))) {
-		if (bread < 0) {
-			ret = S_INTERNAL_SERVER_ERROR;
+	if (!res->dirlisting.started) {
+		if ((ret = dirl_header(fp, res, templates))) {
 			goto cleanup;
 		}
-		remaining -= bread;
-		p = buf;
-		while (bread > 0) {
-			bwritten = write(fd, p, bread);
-			if (bwritten <= 0) {
-				ret = S_REQUEST_TIMEOUT;
-				goto cleanup;
+		res->dirlisting.started = 1;
+	}
+
+	/* entries in the order readdir() returns them */
+	while ((len = ftello(fp)) >= 0 && len < STREAM_CHUNK) {
+		errno = 0;
+		if (!(e = readdir(res->dirlisting.dir))) {
+			if (errno) {
+				ret = S_INTERNAL_SERVER_ERROR;
+			} else if (!(ret = dirl_footer(fp, templates))) {
+				res->dirlisting.eof = 1;
 			}
-			bread -= bwritten;
-			p += bwritten;
+			break;
+		}
+		if (dirl_skip(dirfd(res->dirlisting.dir), e->d_name)) {
+			continue;
+		}
+		if ((ret = dirl_entry(fp, dirfd(res->dirlisting.dir), e,
+		                      templates))) {
+			break;
+		}
+	}
+	if (ret || (len = ftello(fp)) < 0) {
+		ret = S_INTERNAL_SERVER_ERROR;
+		goto cleanup;
+	}
+
+	/* frame the chunk, the size line goes out of the buffer */
+	if (res->dirlisting.chunked) {
+		if ((len > 0 && (fputs("\r\n", fp) == EOF ||
+		     buffer_appendf(buf, "%jx\r\n", (intmax_t)len))) ||
+		    (res->dirlisting.eof && fputs("0\r\n\r\n", fp) == EOF)) {
+			ret = S_INTERNAL_SERVER_ERROR;
 		}
 	}
 cleanup:
-	if (fp) {
-		fclose(fp);
+	if (fclose(fp) && !ret) {
+		ret = S_INTERNAL_SERVER_ERROR;
 	}
 
 	return ret;
 }
+
+enum status
+data_send_dirlisting(int fd, struct response *res, struct buffer *buf,
+                     size_t *progress, int *done)
+{
+	enum status s;
+
+	if (!res->dirlisting.dir) {
+		return send_body(fd, res, buf, progress, done);
+	}
+
+	for (;;) {
+		/* a streamed listing is rendered chunk by chunk */
+		if (!res->dirlisting.eof && *progress == res->body.len) {
+			if ((s = render_dirstream_chunk(res, buf))) {
+				return s;
+			}
+			*progress = 0;
+		}
+
+		if ((s = send_body(fd, res, buf, progress, done))) {
+			return s;
+		}
+		if (!*done || res->dirlisting.eof) {
+			/* wait for the socket to drain or we are through */
+			return 0;
+		}
+		*done = 0;
+	}
+}
+
+size_t
+data_error_len(const struct response *res)
+{
+	int len;
+
+	len = snprintf(NULL, 0, ERROR_PAGE,
+	               res->status, status_str[res->status],
+	               res->status, status_str[res->status]);
+
+	return (len < 0) ? 0 : len;
+}
+
+enum status
+data_send_error(int fd, struct response *res, struct buffer *buf,
+                size_t *progress, int *done)
+{
+	enum status s;
+
+	/* the error page fits behind the header and goes out with it */
+	if (*progress == 0) {
+		if (buffer_appendf(buf, ERROR_PAGE,
+		                   res->status, status_str[res->status],
+		                   res->status, status_str[res->status])) {
+			return S_INTERNAL_SERVER_ERROR;
+		}
+		*progress = data_error_len(res);
+	}
+	s = http_send_buf(fd, buf, NULL, 0, NULL, 0);
+	*done = !s && buf->len == 0;
+
+	return s;
+}
+
+size_t
+data_multipart_len(const struct response *res)
+{
+	size_t i, len = 0;
+	int n;
+
+	for (i = 0; i < res->file.nrange; i++) {
+		if ((n = snprintf(NULL, 0, PART_HEADER, res->file.boundary,
+		                  res->file.type, res->file.range[i].lower,
+		                  res->file.range[i].upper,
+		                  res->file.size)) < 0) {
+			return 0;
+		}
+		len += n + res->file.range[i].upper -
+		       res->file.range[i].lower + 1;
+	}
+	if ((n = snprintf(NULL, 0, PART_END, res->file.boundary)) < 0) {
+		return 0;
+	}
+
+	return len + n;
+}
+
+/* queue the header of the next part, or the closing boundary */
+static enum status
+next_part(struct response *res, struct buffer *buf)
+{
+	const struct range *r;
+
+	if (res->file.part == res->file.nrange) {
+		res->file.part++;
+		return buffer_appendf(buf, PART_END, res->file.boundary) ?
+		       S_INTERNAL_SERVER_ERROR : 0;
+	}
+
+	r = &res->file.range[res->file.part++];
+	res->file.lower = r->lower;
+	res->file.upper = r->upper;
+
+	return buffer_appendf(buf, PART_HEADER, res->file.boundary,
+	                      res->file.type, r->lower, r->upper,
+	                      res->file.size) ? S_INTERNAL_SERVER_ERROR : 0;
+}
+
+static enum status
+prepare_file_buf(struct response *res, struct buffer *buf,
+                      size_t *progress)
+{
+	ssize_t r;
+	size_t remaining;
+
+	/* open file on the first call, it is kept until the response ends */
+	if (res->file.fd < 0 &&
+	    (res->file.fd = open(res->path, O_RDONLY)) < 0) {
+		return S_FORBIDDEN;
+	}
+
+	/* read data until upper bound is hit */
+	remaining = res->file.upper - res->file.lower + 1 - *progress;
+	if (remaining == 0) {
+		return 0;
+	}
+
+	if ((r = pread(res->file.fd, buf->data + buf->len,
+	               MIN(sizeof(buf->data) - buf->len, remaining),
+	               res->file.lower + *progress)) <= 0) {
+		/* error or file was truncated underneath us */
+		return S_INTERNAL_SERVER_ERROR;
+	}
+	buf->len += r;
+	*progress += r;
+
+	return 0;
+}
+
+static int
+xfer_splice_setup(struct response *res)
+{
+	if (pipe(res->file.pipe) < 0) {
+		return 1;
+	}
+
+	/* a larger pipe means fewer round trips per chunk */
+	fcntl(res->file.pipe[1], F_SETPIPE_SZ, FILE_CHUNK);
+	res->file.xfer = XFER_SPLICE;
+
+	return 0;
+}
+
+static void
+xfer_splice_teardown(struct response *res)
+{
+	close(res->file.pipe[0]);
+	close(res->file.pipe[1]);
+	res->file.inpipe = 0;
+	res->file.xfer = XFER_COPY;
+}
+
+enum status
+data_send_file(int fd, struct response *res, struct buffer *buf,
+               size_t *progress, int *done)
+{
+	enum status s;
+	ssize_t r;
+	off_t off;
+	size_t len;
+
+	*done = 0;
+
+	/* the file was loaded into memory, e.g. to compress it */
+	if (res->body.data) {
+		return send_body(fd, res, buf, progress, done);
+	}
+
+	/* open file on the first call, it is kept until the response ends */
+	if (res->file.fd < 0 &&
+	    (res->file.fd = open(res->path, O_RDONLY)) < 0) {
+		return S_FORBIDDEN;
+	}
+
+	/* the first part begins right behind the header */
+	if (res->file.nrange > 1 && res->file.part == 0 &&
+	    (s = next_part(res, buf))) {
+		return s;
+	}
+	len = res->file.upper - res->file.lower + 1;
+
+	/*
+	 * *progress counts the bytes taken from the file, which are
+	 * sent right away or wait in the buffer or the pipe
+	 */
+	for (;;) {
+		/*
+		 * flush pending data (the header at first) and keep it
+		 * back until file data follows, to share a segment
+		 */
+		if (buf->len > 0) {
+			if ((s = http_send_buf(fd, buf, NULL, 0, NULL,
+			                       *progress < len))) {
+				return s;
+			}
+			if (buf->len > 0) {
+				return 0;
+			}
+		}
+		if (res->file.inpipe > 0) {
+			if ((r = splice(res->file.pipe[0], NULL, fd, NULL,
+			                res->file.inpipe, SPLICE_F_MOVE |
+			                SPLICE_F_NONBLOCK)) < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					return 0;
+				}
+				return S_REQUEST_TIMEOUT;
+			}
+			res->file.inpipe -= r;
+			buf->sent += r;
+			continue;
+		}
+
+		if (*progress == len) {
+			if (res->file.nrange < 2 ||
+			    res->file.part > res->file.nrange) {
+				*done = 1;
+				return 0;
+			}
+
+			/* each part is sent like a range of its own */
+			if ((s = next_part(res, buf))) {
+				return s;
+			}
+			if (res->file.part <= res->file.nrange) {
+				len = res->file.upper - res->file.lower + 1;
+				*progress = 0;
+			}
+			continue;
+		}
+
+		off = res->file.lower + *progress;
+
+		switch (res->file.xfer) {
+		case XFER_SENDFILE:
+			/* let the kernel copy from the page cache directly */
+			if ((r = sendfile(fd, res->file.fd, &off,
+			                  MIN(len - *progress, FILE_CHUNK))) < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					return 0;
+				}
+				if (errno != EINVAL && errno != ENOSYS) {
+					return S_REQUEST_TIMEOUT;
+				}
+
+				/* not supported here, try to splice instead */
+				if (xfer_splice_setup(res)) {
+					res->file.xfer = XFER_COPY;
+				}
+				continue;
+			}
+			buf->sent += r;
+			break;
+		case XFER_SPLICE:
+			/* move file pages into the pipe, flushed above */
+			if ((r = splice(res->file.fd, &off, res->file.pipe[1],
+			                NULL, MIN(len - *progress, FILE_CHUNK),
+			                SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0) {
+				if (errno != EINVAL && errno != ENOSYS) {
+					return S_INTERNAL_SERVER_ERROR;
+				}
+
+				/* not supported either, fall back to copying */
+				xfer_splice_teardown(res);
+				continue;
+			}
+			res->file.inpipe += r;
+			break;
+		case XFER_COPY:
+		default:
+			if ((s = prepare_file_buf(res, buf, progress))) {
+				return s;
+			}
+			continue;
+		}
+
+		if (r == 0) {
+			/* file was truncated underneath us */
+			return S_INTERNAL_SERVER_ERROR;
+		}
+		*progress += r;
+	}
+}
+
+void
+data_release(struct response *res)
+{
+	switch (res->type) {
+	case RESTYPE_FILE:
+		if (res->file.fe) {
+			fdcache_release(res->file.fe);
+			res->file.fe = NULL;
+		} else if (res->file.fd >= 0) {
+			close(res->file.fd);
+		}
+		res->file.fd = -1;
+		if (res->file.xfer == XFER_SPLICE) {
+			xfer_splice_teardown(res);
+		}
+		break;
+	case RESTYPE_DIRLISTING:
+		if (res->dirlisting.dir) {
+			closedir(res->dirlisting.dir);
+			res->dirlisting.dir = NULL;
+		}
+		break;
+	default:
+		break;
+	}
+	free(res->body.data);
+	res->body.data = NULL;
+	res->body.len = 0;
+}
@@ -2,10 +2,32 @@
 #ifndef DATA_H
 #define DATA_H
 
+#include <stdint.h>
+
 #include "http.h"
+#include "util.h"
+
+extern enum status (* const data_fct[])(int, struct response *,
+                                        struct buffer *, size_t *, int *);
+
+struct cache;
+
+int data_listing_validator(const struct response *, uint64_t *, time_t *);
+enum status data_render_dirlisting(struct response *, struct cache *,
+                                   enum encoding *);
+int data_compress_file(struct response *, const struct stat *,
+                       struct cache *, enum encoding);
+int data_load_file(struct response *, const struct stat *, struct cache *);
+size_t data_error_len(const struct response *);
+size_t data_multipart_len(const struct response *);
 
-enum status data_send_dirlisting(int, const struct response *);
-enum status data_send_error(int, const struct response *);
-enum status data_send_file(int, const struct response *);
+enum status data_open_dirstream(struct response *, int);
+enum status data_send_dirlisting(int, struct response *, struct buffer *,
+                                 size_t *, int *);
+enum status data_send_error(int, struct response *, struct buffer *,
+                            size_t *, int *);
+enum status data_send_file(int, struct response *, struct buffer *,
+                           size_t *, int *);
+void data_release(struct response *);
 
 #endif /* DATA_H */
@@ -1,4 +1,5 @@
 /* See LICENSE file for copyright and license details. */
+#define _GNU_SOURCE /* statx() */
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -13,7 +14,9 @@
 
 #include "config.h"
 #include "dirl.h"
+#include "escape.h"
 #include "http.h"
+#include "stats.h"
 #include "util.h"
 
 static char*
@@ -33,47 +36,74 @@ suffix(int t)
   return "";
 }
 
-static void
-html_escape(const char* src, char* dst, size_t dst_siz)
-{
-  const struct
-  {
-    char c;
-    char* s;
-  } escape[] = {
-    { '&', "&amp;" },  { '<', "&lt;" },    { '>', "&gt;" },
-    { '"', "&quot;" }, { '\'', "&#x27;" },
-  };
-  size_t i, j, k, esclen;
+/* Cache of directories known to contain template files or not
+ *
+ * Adding or removing a template file changes the mtime of its directory, so a
+ * directory only has to be scanned again when its mtime has changed.
+ */
+static struct
+{
+  char* path;
+  struct fileid id;
+  int has_templ;
+} dircache[TEMPLCACHE_DIRS];
 
-  for (i = 0, j = 0; src[i] != '\0'; i++) {
-    for (k = 0; k < LEN(escape); k++) {
-      if (src[i] == escape[k].c) {
-        break;
-      }
-    }
-    if (k == LEN(escape)) {
-      /* no escape char at src[i] */
-      if (j == dst_siz - 1) {
-        /* silent truncation */
-        break;
-      } else {
-        dst[j++] = src[i];
-      }
-    } else {
-      /* escape char at src[i] */
-      esclen = strlen(escape[k].s);
+/* Cache of templates loaded and compiled from a template directory */
+static struct dirl_templ templcache[TEMPLCACHE_DIRS];
 
-      if (j >= dst_siz - esclen) {
-        /* silent truncation */
-        break;
-      } else {
-        memcpy(&dst[j], escape[k].s, esclen);
-        j += esclen;
-      }
+static const char* templ_name[] = { DIRL_HEADER, DIRL_ENTRY, DIRL_FOOTER };
+
+static size_t
+dirl_hash(const char* s)
+{
+  size_t h = 5381;
+
+  while (*s) {
+    h = h * 33 + (unsigned char)*s++;
+  }
+
+  return h;
+}
+
+/* Check if dir contains one of the template files */
+static int
+dirl_has_templ(const char* dir)
+{
+  size_t i = dirl_hash(dir) % LEN(dircache);
+  struct fileid id;
+  struct stat st;
+
+  if (stat(dir, &st) < 0) {
+    return 0;
+  }
+  fileid_set(&id, &st);
+  if (dircache[i].path && !strcmp(dircache[i].path, dir) &&
+      !memcmp(&dircache[i].id, &id, sizeof(id))) {
+    return dircache[i].has_templ;
+  }
+
+  int has_templ = 0;
+  DIR* cur = opendir(dir);
+  struct dirent* de;
+  while (cur && !has_templ && (de = readdir(cur))) {
+    if (de->d_type == DT_REG) {
+      has_templ = !strcmp(DIRL_HEADER, de->d_name) ||
+                  !strcmp(DIRL_ENTRY, de->d_name) ||
+                  !strcmp(DIRL_FOOTER, de->d_name);
     }
   }
-  dst[j] = '\0';
+  if (cur) {
+    closedir(cur);
+  }
+
+  /* the id was taken before scanning, so changes meanwhile are noticed */
+  free(dircache[i].path);
+  if ((dircache[i].path = strdup(dir))) {
+    dircache[i].id = id;
+    dircache[i].has_templ = has_templ;
+  }
+
+  return has_templ;
 }
 
 /* Try to find templates up until root
@@ -95,17 +125,8 @@ dirl_find_templ_dir(const char* start_path)
   }
 
   while (strlen(path_buf) != 0) {
-    DIR* cur = opendir(path_buf);
-    struct dirent* de;
-    errno = 0;
-    while ((de = readdir(cur))) {
-      if (de->d_type == DT_REG) {
-        if (!strcmp(DIRL_HEADER, de->d_name) || !strcmp(DIRL_ENTRY, de->d_name) ||
-            !strcmp(DIRL_FOOTER, de->d_name)) {
-          closedir(cur);
-          return path_buf;
-        }
-      }
+    if (dirl_has_templ(path_buf)) {
+      return path_buf;
     }
 
     if (strlen(path_buf) > 1) {
@@ -125,127 +146,360 @@ dirl_find_templ_dir(const char* start_path)
   return NULL;
 }
 
+/* Helper function to build the path of template file name in base */
+static char*
+dirl_templ_path(const char* base, const char* name)
+{
+  size_t len = strlen(base);
+  char* path = calloc(sizeof(char), len + 1 + strlen(name) + 1);
+  if (!path) {
+    return NULL;
+  }
+  strcpy(path, base);
+  if (len == 0 || base[len - 1] != '/') {
+    strcat(path, "/");
+  }
+  strcat(path, name);
+
+  return path;
+}
+
 /* Helper function to fill template from base+name if file exists */
 static void
 dirl_fill_templ(char** templ, char* base, char* name, char* def)
 {
   if (!base || !name) {
-    *templ = def;
+    *templ = strdup(def);
     return;
   }
 
-  char* path = calloc(sizeof(char), strlen(base) + strlen(name));
-  strcpy(path, base);
-  strcat(path, name);
-
-  char* file_buf = read_file(path);
+  char* path = dirl_templ_path(base, name);
+  char* file_buf = path ? read_file(path) : NULL;
   free(path);
 
   if (file_buf) {
     *templ = file_buf;
   } else {
-    *templ = def;
+    *templ = strdup(def);
+  }
+}
+
+/* Placeholders and the templates they are substituted in */
+static const struct
+{
+  const char* name;
+  size_t len;
+  enum dirl_op op;
+} placeholder[] = {
+  { "{uri}", sizeof("{uri}") - 1, DIRL_OP_URI },
+  { "{entry}", sizeof("{entry}") - 1, DIRL_OP_ENTRY },
+  { "{suffix}", sizeof("{suffix}") - 1, DIRL_OP_SUFFIX },
+  { "{size}", sizeof("{size}") - 1, DIRL_OP_SIZE },
+  { "{modified}", sizeof("{modified}") - 1, DIRL_OP_MODIFIED },
+};
+
+#define OPS_HEADER (1 << DIRL_OP_URI)
+#define OPS_ENTRY                                                              \
+  ((1 << DIRL_OP_ENTRY) | (1 << DIRL_OP_SUFFIX) | (1 << DIRL_OP_SIZE) |        \
+   (1 << DIRL_OP_MODIFIED))
+#define OPS_FOOTER 0
+
+/* Compile templ into literal spans and the placeholders in the ops mask
+ *
+ * Placeholders not in ops are kept as literal text, like they always were.
+ */
+static void
+dirl_compile(struct dirl_prog* prog, const char* templ, unsigned ops)
+{
+  const char* lit = templ;
+  const char* p;
+  size_t nbrace = 0, i;
+
+  /* each brace can at most end a literal and start a placeholder */
+  for (p = templ; (p = strchr(p, '{')); p++) {
+    nbrace++;
+  }
+  prog->nseg = 0;
+  prog->ops = 0;
+  if (!(prog->seg = calloc(2 * nbrace + 1, sizeof(*prog->seg)))) {
+    return;
+  }
+
+  for (p = templ; (p = strchr(p, '{'));) {
+    for (i = 0; i < LEN(placeholder); i++) {
+      if ((ops & (1 << placeholder[i].op)) &&
+          !strncmp(p, placeholder[i].name, placeholder[i].len)) {
+        break;
+      }
+    }
+    if (i == LEN(placeholder)) {
+      p++;
+      continue;
+    }
+
+    if (p > lit) {
+      prog->seg[prog->nseg++] =
+        (struct dirl_seg){ DIRL_OP_LITERAL, lit, p - lit };
+    }
+    prog->seg[prog->nseg++] = (struct dirl_seg){ placeholder[i].op, NULL, 0 };
+    prog->ops |= 1 << placeholder[i].op;
+    p += placeholder[i].len;
+    lit = p;
+  }
+  if (*lit) {
+    prog->seg[prog->nseg++] =
+      (struct dirl_seg){ DIRL_OP_LITERAL, lit, strlen(lit) };
+  }
+}
+
+/* Write the compiled template, filling in placeholders from val */
+static enum status
+dirl_run(FILE* fp, const struct dirl_prog* prog, const char* const val[])
+{
+  const struct dirl_seg* seg;
+  size_t len;
+
+  if (!prog->seg) {
+    return S_INTERNAL_SERVER_ERROR;
+  }
+
+  for (seg = prog->seg; seg < prog->seg + prog->nseg; seg++) {
+    if (seg->op == DIRL_OP_LITERAL) {
+      len = seg->len;
+      if (fwrite(seg->s, 1, len, fp) != len) {
+        return S_INTERNAL_SERVER_ERROR;
+      }
+    } else if (fputs(val[seg->op], fp) == EOF) {
+      return S_INTERNAL_SERVER_ERROR;
+    }
+  }
+
+  return 0;
+}
+
+static void
+dirl_free_templ(struct dirl_templ* templ)
+{
+  free(templ->header);
+  free(templ->entry);
+  free(templ->footer);
+  free(templ->dir);
+  free(templ->header_prog.seg);
+  free(templ->entry_prog.seg);
+  free(templ->footer_prog.seg);
+  memset(templ, 0, sizeof(*templ));
+}
+
+/* Read and compile the templates in dir, or the defaults if dir is NULL */
+static int
+dirl_load_templ(struct dirl_templ* templ, char* dir)
+{
+  dirl_fill_templ(&templ->header, dir, DIRL_HEADER, DIRL_HEADER_DEFAULT);
+  dirl_fill_templ(&templ->entry, dir, DIRL_ENTRY, DIRL_ENTRY_DEFAULT);
+  dirl_fill_templ(&templ->footer, dir, DIRL_FOOTER, DIRL_FOOTER_DEFAULT);
+  templ->dir = dir;
+
+  if (!templ->header || !templ->entry || !templ->footer) {
+    dirl_free_templ(templ);
+    return 1;
   }
+
+  dirl_compile(&templ->header_prog, templ->header, OPS_HEADER);
+  dirl_compile(&templ->entry_prog, templ->entry, OPS_ENTRY);
+  dirl_compile(&templ->footer_prog, templ->footer, OPS_FOOTER);
+
+  return 0;
+}
+
+/* Stat template file name in the template directory dir */
+static int
+dirl_stat_templ(const char* dir, const char* name, struct stat* st)
+{
+  char* path = dirl_templ_path(dir, name);
+  int ret = path ? stat(path, st) : -1;
+
+  free(path);
+  return ret;
 }
 
-struct dirl_templ
-dirl_read_templ(const char* path)
+const struct dirl_templ*
+dirl_get_templ(const char* path)
 {
-  struct dirl_templ templ;
+  static struct dirl_templ defaults;
+  struct fileid id[3];
+  struct stat st;
+  size_t i, j;
 
   char* templ_dir = dirl_find_templ_dir(path);
 
-  dirl_fill_templ(&templ.header, templ_dir, DIRL_HEADER, DIRL_HEADER_DEFAULT);
-  dirl_fill_templ(&templ.entry, templ_dir, DIRL_ENTRY, DIRL_ENTRY_DEFAULT);
-  dirl_fill_templ(&templ.footer, templ_dir, DIRL_FOOTER, DIRL_FOOTER_DEFAULT);
+  if (!templ_dir) {
+    if (!defaults.header && dirl_load_templ(&defaults, NULL)) {
+      return NULL;
+    }
+    return &defaults;
+  }
+
+  /* template files edited in place don't change the directory mtime */
+  memset(id, 0, sizeof(id));
+  for (j = 0; j < LEN(id); j++) {
+    if (!dirl_stat_templ(templ_dir, templ_name[j], &st)) {
+      fileid_set(&id[j], &st);
+    }
+  }
+
+  i = dirl_hash(templ_dir) % LEN(templcache);
+  if (templcache[i].dir && !strcmp(templcache[i].dir, templ_dir) &&
+      !memcmp(templcache[i].id, id, sizeof(id))) {
+    free(templ_dir);
+    stats_cache(STATS_TEMPL, 1);
+    return &templcache[i];
+  }
+  stats_cache(STATS_TEMPL, 0);
 
-  free(templ_dir);
+  dirl_free_templ(&templcache[i]);
+  if (dirl_load_templ(&templcache[i], templ_dir)) {
+    return NULL;
+  }
+  memcpy(templcache[i].id, id, sizeof(id));
 
-  return templ;
+  return &templcache[i];
 }
 
 enum status
-dirl_header(int fd, const struct response* res, const struct dirl_templ* templ)
+dirl_header(FILE* fp, const struct response* res, const struct dirl_templ* templ)
 {
-  /* Replace placeholder */
-  char* nhead = calloc(sizeof(char), strlen(templ->header) + 1);
-  memcpy(nhead, templ->header, strlen(templ->header) + 1);
-  replace(&nhead, "{uri}", res->uri);
+  static char esc[PATH_MAX * 6];
+  const char* val[NUM_DIRL_OPS] = { [DIRL_OP_URI] = esc };
 
-  /* Write header */
-  write(fd, nhead, strlen(nhead));
+  html_escape(res->uri, esc, sizeof(esc));
 
-  free(nhead);
+  return dirl_run(fp, &templ->header_prog, val);
+}
 
-  /* listing header */
-  return 0;
+/* Get size and modification time of name in the directory dirfd
+ *
+ * Only the attributes in mask are requested, relative to the open directory so
+ * the path is not resolved again for every entry.
+ */
+static void
+dirl_stat_entry(int dirfd,
+                const char* name,
+                unsigned int mask,
+                off_t* size,
+                time_t* mtime)
+{
+  static int no_statx;
+  struct statx stx;
+  struct stat st;
+
+  if (!no_statx) {
+    if (!statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, mask,
+               &stx)) {
+      *size = stx.stx_size;
+      *mtime = stx.stx_mtime.tv_sec;
+      return;
+    }
+    if (errno != ENOSYS) {
+      return;
+    }
+    no_statx = 1;
+  }
+
+  if (!fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+    *size = st.st_size;
+    *mtime = st.st_mtim.tv_sec;
+  }
 }
 
 enum status
-dirl_entry(int fd,
+dirl_entry(FILE* fp,
+           int dirfd,
            const struct dirent* entry,
-           const struct response* res,
            const struct dirl_templ* templ)
 {
-  struct stat stat_buf;
-  char* path_buf = calloc(sizeof(char), strlen(res->path)+strlen(entry->d_name));
-  strcat(path_buf, res->uri);
-  strcat(path_buf, entry->d_name);
-  lstat(path_buf, &stat_buf);
-
-  char* nentry = calloc(sizeof(char), strlen(templ->entry) + 1);
-  memcpy(nentry, templ->entry, strlen(templ->entry) + 1);
-
-  /* Replace placeholder */
-  char esc[PATH_MAX * 6];
-  html_escape(entry->d_name, esc, PATH_MAX * 6);
-  replace(&nentry, "{entry}", entry->d_name);
+  const struct dirl_prog* prog = &templ->entry_prog;
+  unsigned int mask = 0;
+  off_t size = 0;
+  time_t mtime = 0;
+
+  /* Only stat what the template shows */
+  if (entry->d_type == DT_REG && (prog->ops & (1 << DIRL_OP_SIZE))) {
+    mask |= STATX_SIZE;
+  }
+  if (prog->ops & (1 << DIRL_OP_MODIFIED)) {
+    mask |= STATX_MTIME;
+  }
+  if (mask) {
+    dirl_stat_entry(dirfd, entry->d_name, mask, &size, &mtime);
+  }
 
-  replace(&nentry, "{suffix}", suffix(entry->d_type));
+  char esc[NAME_MAX * 6 + 1];
+  html_escape(entry->d_name, esc, sizeof(esc));
 
   char size_buf[1024];
   if (entry->d_type == DT_REG) {
-    snprintf(size_buf, 1024, "%ld", stat_buf.st_size);
+    snprintf(size_buf, 1024, "%ld", size);
   } else {
     sprintf(size_buf, "-");
   }
-  replace(&nentry, "{size}", size_buf);
 
   char time_buf[1024];
   struct tm tm;
-  gmtime_r(&stat_buf.st_mtim.tv_sec, &tm);
+  gmtime_r(&mtime, &tm);
   strftime(time_buf, 1024, "%F %H:%m", &tm);
-  replace(&nentry, "{modified}", time_buf);
 
   /* Write entry */
-  write(fd, nentry, strlen(nentry));
-
-  free(nentry);
+  const char* val[NUM_DIRL_OPS] = {
+    [DIRL_OP_ENTRY] = esc,
+    [DIRL_OP_SUFFIX] = suffix(entry->d_type),
+    [DIRL_OP_SIZE] = size_buf,
+    [DIRL_OP_MODIFIED] = time_buf,
+  };
 
-  return 0;
+  return dirl_run(fp, prog, val);
 }
 
 enum status
-dirl_footer(int fd, const struct dirl_templ* templ)
+dirl_footer(FILE* fp, const struct dirl_templ* templ)
 {
-  /* Replace placeholder */
-  char* nfoot = calloc(sizeof(char), strlen(templ->footer) + 1);
-  memcpy(nfoot, templ->footer, strlen(templ->footer) + 1);
+  const char* val[NUM_DIRL_OPS] = { 0 };
 
-  /* Write footer */
-  write(fd, nfoot, strlen(nfoot));
+  return dirl_run(fp, &templ->footer_prog, val);
+}
 
-  free(nfoot);
-  return 0;
+int
+dirl_streamed(const char* path)
+{
+  char* marker = dirl_templ_path(path, DIRL_STREAM);
+  int ret = marker && !access(marker, F_OK);
+
+  free(marker);
+  return ret;
+}
+
+static int
+gzip_sidecar(int dirfd, const char* name)
+{
+  char orig[NAME_MAX + 1];
+  size_t len = strlen(name);
+
+  if (len <= 3 || len > NAME_MAX || strcmp(name + len - 3, ".gz")) {
+    return 0;
+  }
+  memcpy(orig, name, len - 3);
+  orig[len - 3] = '\0';
+
+  return !faccessat(dirfd, orig, F_OK, AT_SYMLINK_NOFOLLOW);
 }
 
 int
-dirl_skip(const char* name)
-{
-  return name[0] == '.'                //
-         || !strcmp(name, DIRL_HEADER) //
-         || !strcmp(name, DIRL_ENTRY)  //
-         || !strcmp(name, DIRL_FOOTER) //
-         || !strcmp(name, DIRL_STYLE)  //
-         || !strcmp(name, FAVICON);    //
+dirl_skip(int dirfd, const char* name)
+{
+  return name[0] == '.'                                       //
+         || !strcmp(name, DIRL_HEADER)                        //
+         || !strcmp(name, DIRL_ENTRY)                         //
+         || !strcmp(name, DIRL_FOOTER)                        //
+         || !strcmp(name, DIRL_STYLE)                         //
+         || !strcmp(name, FAVICON)                            //
+         || (GZIP_HIDE_SIDECARS && gzip_sidecar(dirfd, name)); //
 }
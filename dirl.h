@@ -3,15 +3,18 @@
 #define DIRL_H
 
 #include <dirent.h>
+#include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include "http.h"
+#include "util.h"
 
 #define DIRL_HEADER ".header.tpl"
 #define DIRL_ENTRY  ".entry.tpl"
 #define DIRL_FOOTER ".footer.tpl"
 #define DIRL_STYLE  "style.css"
+#define DIRL_STREAM ".dirl-stream"
 #define FAVICON     "favicon.ico"
 
 /* Default template definitions
@@ -47,15 +50,63 @@
   "</body>\n"                                                                  \
   "</html>"
 
+/* Template program opcodes
+ *
+ * A template is compiled into a sequence of segments, each either a literal
+ * span of the template text or a placeholder to fill in when rendering.
+ */
+enum dirl_op
+{
+  DIRL_OP_LITERAL,
+  DIRL_OP_URI,
+  DIRL_OP_ENTRY,
+  DIRL_OP_SUFFIX,
+  DIRL_OP_SIZE,
+  DIRL_OP_MODIFIED,
+  NUM_DIRL_OPS,
+};
+
+struct dirl_seg
+{
+  enum dirl_op op;
+  const char* s; /* literal span, points into the template text */
+  size_t len;
+};
+
+struct dirl_prog
+{
+  struct dirl_seg* seg;
+  size_t nseg;
+  unsigned ops; /* mask of the placeholders used */
+};
+
 struct dirl_templ
 {
   char* header;
   char* entry;
   char* footer;
+  char* dir; /* directory the templates were read from, or NULL */
+  struct fileid id[3]; /* header, entry and footer files as they were read */
+  struct dirl_prog header_prog;
+  struct dirl_prog entry_prog;
+  struct dirl_prog footer_prog;
 };
 
-struct dirl_templ
-dirl_read_templ(const char* path);
+/* Get the templates for the listing of path
+ *
+ * The templates are cached and stay valid until the next call. Returns NULL
+ * if they could not be loaded.
+ */
+const struct dirl_templ*
+dirl_get_templ(const char* path);
+
+/* Determine if the directory at path is to be streamed
+ *
+ * Directories opt in by containing DIRL_STREAM. Their listing is sent unsorted
+ * while the directory is read, instead of being rendered as a whole first.
+ */
+int
+dirl_streamed(const char* path);
 
 /* Determine if an dirlist entry should be skipped
  *
@@ -66,20 +117,21 @@ dirl_read_templ(const char* path);
  * - entry template: DIRL_ENTRY
  * - footer template: DIRL_FOOTER
  * - dirlist style: DRIL_STYLE
+ * - "x.gz" next to "x" in dirfd, with GZIP_HIDE_SIDECARS
  */
 int
-dirl_skip(const char*);
+dirl_skip(int dirfd, const char*);
 
 /* Print header into the response */
 enum status
-dirl_header(int, const struct response*, const struct dirl_templ*);
+dirl_header(FILE*, const struct response*, const struct dirl_templ*);
 
-/* Print entry into the response */
+/* Print entry of the open directory dirfd into the response */
 enum status
-dirl_entry(int, const struct dirent*, const struct response*, const struct dirl_templ*);
+dirl_entry(FILE*, int dirfd, const struct dirent*, const struct dirl_templ*);
 
 /* Print footer into the response */
 enum status
-dirl_footer(int, const struct dirl_templ*);
+dirl_footer(FILE*, const struct dirl_templ*);
 
 #endif /* DIRL_H */
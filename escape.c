@@ -0,0 +1,197 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "escape.h"
+#include "util.h"
+
+enum kind {
+	K_DECODE,
+	K_ENCODE,
+	K_HTML,
+};
+
+static const char hexdigit[] = "0123456789ABCDEF";
+
+/* the value of each hex digit plus one, 0 for any other byte */
+static const unsigned char hexval[256] = {
+	['0'] = 1,  ['1'] = 2,  ['2'] = 3,  ['3'] = 4,  ['4'] = 5,
+	['5'] = 6,  ['6'] = 7,  ['7'] = 8,  ['8'] = 9,  ['9'] = 10,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15,
+	['F'] = 16, ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14,
+	['e'] = 15, ['f'] = 16,
+};
+
+static const char *const entity[256] = {
+	['&'] = "&amp;", ['<'] = "&lt;", ['>'] = "&gt;", ['"'] = "&quot;",
+	['\''] = "&#x27;",
+};
+
+static int
+special(enum kind k, unsigned char c)
+{
+	switch (k) {
+	case K_DECODE:
+		return c == '%';
+	case K_ENCODE:
+		return c < 0x20 || c >= 0x7f;
+	default:
+		return entity[c] != NULL;
+	}
+}
+
+#if defined(__AVX2__)
+typedef __m256i vec;
+#define VEC_LEN      32
+#define vec_load(p)  _mm256_loadu_si256((const vec *)(p))
+#define vec_set(c)   _mm256_set1_epi8(c)
+#define vec_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define vec_lt(a, b) _mm256_cmpgt_epi8(b, a)
+#define vec_or(a, b) _mm256_or_si256(a, b)
+#define vec_mask(a)  (uint32_t)_mm256_movemask_epi8(a)
+#elif defined(__SSE2__)
+typedef __m128i vec;
+#define VEC_LEN      16
+#define vec_load(p)  _mm_loadu_si128((const vec *)(p))
+#define vec_set(c)   _mm_set1_epi8(c)
+#define vec_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define vec_lt(a, b) _mm_cmplt_epi8(a, b)
+#define vec_or(a, b) _mm_or_si128(a, b)
+#define vec_mask(a)  (uint32_t)_mm_movemask_epi8(a)
+#endif
+
+/* the length of the run at the start of s[0..len) that stays as it is */
+static size_t
+plain(enum kind k, const char *s, size_t len)
+{
+	size_t i = 0;
+#ifdef VEC_LEN
+	vec v, m;
+	uint32_t bits;
+
+	for (; i + VEC_LEN <= len; i += VEC_LEN) {
+		v = vec_load(s + i);
+		switch (k) {
+		case K_DECODE:
+			m = vec_eq(v, vec_set('%'));
+			break;
+		case K_ENCODE:
+			/* compared signed, bytes above 0x7f are below 0x20 */
+			m = vec_or(vec_lt(v, vec_set(0x20)),
+			           vec_eq(v, vec_set(0x7f)));
+			break;
+		default:
+			m = vec_or(vec_or(vec_eq(v, vec_set('&')),
+			                  vec_eq(v, vec_set('<'))),
+			           vec_or(vec_or(vec_eq(v, vec_set('>')),
+			                         vec_eq(v, vec_set('"'))),
+			                  vec_eq(v, vec_set('\''))));
+		}
+		if ((bits = vec_mask(m))) {
+			return i + __builtin_ctz(bits);
+		}
+	}
+#endif
+	for (; i < len && !special(k, (unsigned char)s[i]); i++)
+		;
+
+	return i;
+}
+
+size_t
+url_decode(const char *src, char *dst)
+{
+	size_t i, j, n, len = strlen(src);
+	unsigned char hi, lo;
+
+	for (i = 0, j = 0; ; ) {
+		n = plain(K_DECODE, src + i, len - i);
+		if (dst + j != src + i) {
+			memmove(dst + j, src + i, n);
+		}
+		i += n;
+		j += n;
+		if (i == len) {
+			break;
+		}
+
+		/* src[i] is '%', a valid escape is decoded, else kept */
+		if ((hi = hexval[(unsigned char)src[i + 1]]) &&
+		    (lo = hexval[(unsigned char)src[i + 2]])) {
+			dst[j++] = ((hi - 1) << 4) | (lo - 1);
+			i += 3;
+		} else {
+			dst[j++] = src[i++];
+		}
+	}
+	dst[j] = '\0';
+
+	return j;
+}
+
+size_t
+url_encode(const char *src, char *dst, size_t siz)
+{
+	size_t i, j, n, len = strlen(src);
+	unsigned char c;
+
+	if (siz == 0) {
+		return 0;
+	}
+	for (i = 0, j = 0; i < len; ) {
+		n = MIN(plain(K_ENCODE, src + i, len - i), siz - 1 - j);
+		memcpy(dst + j, src + i, n);
+		i += n;
+		j += n;
+		if (i == len || siz - 1 - j < 3) {
+			/* done or silent truncation */
+			break;
+		}
+
+		c = src[i++];
+		dst[j++] = '%';
+		dst[j++] = hexdigit[c >> 4];
+		dst[j++] = hexdigit[c & 0xf];
+	}
+	dst[j] = '\0';
+
+	return j;
+}
+
+size_t
+html_escape(const char *src, char *dst, size_t siz)
+{
+	size_t i, j, n, elen, len = strlen(src);
+	const char *e;
+
+	if (siz == 0) {
+		return 0;
+	}
+	for (i = 0, j = 0; i < len; ) {
+		n = MIN(plain(K_HTML, src + i, len - i), siz - 1 - j);
+		memcpy(dst + j, src + i, n);
+		i += n;
+		j += n;
+		if (i == len || j == siz - 1) {
+			/* done or silent truncation */
+			break;
+		}
+
+		e = entity[(unsigned char)src[i++]];
+		if ((elen = strlen(e)) > siz - 1 - j) {
+			/* silent truncation */
+			break;
+		}
+		memcpy(dst + j, e, elen);
+		j += elen;
+	}
+	dst[j] = '\0';
+
+	return j;
+}
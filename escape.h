@@ -0,0 +1,23 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef ESCAPE_H
+#define ESCAPE_H
+
+#include <stddef.h>
+
+/*
+ * Each function copies src to dst, transforming the few bytes that
+ * need it. The runs between them are found a vector at a time where
+ * SSE2 or AVX2 is available and copied in one go. All return the
+ * length of the null-terminated result.
+ */
+
+/* turn "%XX" into its byte, dst may be src */
+size_t url_decode(const char *src, char *dst);
+
+/* turn control and non-ASCII bytes into "%XX", truncating to fit */
+size_t url_encode(const char *src, char *dst, size_t siz);
+
+/* turn &, <, >, " and ' into entities, truncating to fit */
+size_t html_escape(const char *src, char *dst, size_t siz);
+
+#endif /* ESCAPE_H */
@@ -0,0 +1,143 @@
+/* See LICENSE file for copyright and license details. */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "fdcache.h"
+#include "stats.h"
+#include "util.h"
+
+/*
+ * Paths map to a fixed slot. A path looked up there takes the slot
+ * over, unless a response is still sending from the descriptor in it.
+ */
+static struct fdcache_entry {
+	char *path;          /* NULL if the slot is unused */
+	int err;             /* errno of the failed stat(), or 0 */
+	int fd;              /* -1 unless a readable regular file */
+	struct stat st;
+	time_t checked;
+	unsigned int refs;   /* responses sending from fd */
+} fdcache[FDCACHE_ENTRIES];
+
+static size_t
+hash(const char *s)
+{
+	size_t h = 5381;
+
+	while (*s) {
+		h = h * 33 + (unsigned char)*s++;
+	}
+
+	return h;
+}
+
+static int
+unchanged(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+	       a->st_mode == b->st_mode && a->st_size == b->st_size &&
+	       a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+	       a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+	       a->st_ctim.tv_sec == b->st_ctim.tv_sec &&
+	       a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+/* the up to date slot of path, or NULL if it can't be cached now */
+static struct fdcache_entry *
+lookup(const char *path)
+{
+	struct fdcache_entry *e;
+	struct stat st;
+	time_t now = time(NULL);
+	int err, same;
+
+	e = &fdcache[hash(path) % LEN(fdcache)];
+	same = e->path && !strcmp(e->path, path);
+	if (same && now - e->checked < FDCACHE_VALID) {
+		stats_cache(STATS_FD, 1);
+		return e;
+	}
+
+	/* check again, a file that is still the same keeps its slot */
+	err = (stat(path, &st) < 0) ? errno : 0;
+	if (same && (err ? err == e->err : !e->err && unchanged(&st, &e->st))) {
+		e->checked = now;
+		stats_cache(STATS_FD, 1);
+		return e;
+	}
+	stats_cache(STATS_FD, 0);
+	if (e->refs > 0) {
+		return NULL;
+	}
+
+	if (e->path && e->fd >= 0) {
+		close(e->fd);
+	}
+	free(e->path);
+	memset(e, 0, sizeof(*e));
+	e->fd = -1;
+	if (!(e->path = strdup(path))) {
+		return NULL;
+	}
+	e->err = err;
+	if (!err) {
+		e->st = st;
+	}
+	e->checked = now;
+
+	/* describe what was opened, it may have been replaced meanwhile */
+	if (!err && S_ISREG(st.st_mode) &&
+	    (e->fd = open(path, O_RDONLY)) >= 0 && fstat(e->fd, &e->st) < 0) {
+		close(e->fd);
+		e->fd = -1;
+	}
+
+	return e;
+}
+
+int
+fdcache_stat(const char *path, struct stat *st)
+{
+	struct fdcache_entry *e;
+
+	if (!(e = lookup(path))) {
+		return stat(path, st);
+	}
+	if (e->err) {
+		errno = e->err;
+		return -1;
+	}
+	*st = e->st;
+
+	return 0;
+}
+
+/*
+ * hand out the descriptor of a readable regular file, which stays
+ * open until it is released
+ */
+struct fdcache_entry *
+fdcache_acquire(const char *path, int *fd)
+{
+	struct fdcache_entry *e;
+
+	if (!(e = lookup(path)) || e->fd < 0) {
+		return NULL;
+	}
+	e->refs++;
+	*fd = e->fd;
+
+	return e;
+}
+
+void
+fdcache_release(struct fdcache_entry *e)
+{
+	e->refs--;
+}
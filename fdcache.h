@@ -0,0 +1,20 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef FDCACHE_H
+#define FDCACHE_H
+
+#include <sys/stat.h>
+
+/*
+ * Each worker remembers what looking up its most requested paths
+ * gave: the stat data or the error, and an open descriptor for
+ * readable regular files. Lookups within FDCACHE_VALID seconds of
+ * the last check take no system call at all.
+ */
+
+struct fdcache_entry;
+
+int fdcache_stat(const char *, struct stat *);
+struct fdcache_entry *fdcache_acquire(const char *, int *);
+void fdcache_release(struct fdcache_entry *);
+
+#endif /* FDCACHE_H */
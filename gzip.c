@@ -0,0 +1,52 @@
+/* See LICENSE file for copyright and license details. */
+#include <limits.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+#include "config.h"
+#include "gzip.h"
+#include "http.h"
+
+/*
+ * compress len bytes at in into a newly allocated *out, returns 1 if
+ * that failed or didn't make it any smaller
+ */
+int
+gzip_compress(enum encoding enc, const char *in, size_t len, char **out,
+              size_t *outlen)
+{
+	z_stream z = { 0 };
+	uLong bound;
+
+	if (len == 0 || len > UINT_MAX) {
+		return 1;
+	}
+
+	/* the window bits select the gzip or the zlib wrapper */
+	if (deflateInit2(&z, GZIP_LEVEL, Z_DEFLATED,
+	                 (enc == ENC_GZIP) ? MAX_WBITS + 16 : MAX_WBITS,
+	                 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return 1;
+	}
+	bound = deflateBound(&z, len);
+	if (!(*out = malloc(bound))) {
+		deflateEnd(&z);
+		return 1;
+	}
+
+	/* the output buffer is large enough to finish in one go */
+	z.next_in = (Bytef *)in;
+	z.avail_in = len;
+	z.next_out = (Bytef *)*out;
+	z.avail_out = bound;
+	if (deflate(&z, Z_FINISH) != Z_STREAM_END || z.total_out >= len) {
+		deflateEnd(&z);
+		free(*out);
+		*out = NULL;
+		return 1;
+	}
+	*outlen = z.total_out;
+	deflateEnd(&z);
+
+	return 0;
+}
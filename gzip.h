@@ -0,0 +1,11 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef GZIP_H
+#define GZIP_H
+
+#include <stddef.h>
+
+#include "http.h"
+
+int gzip_compress(enum encoding, const char *, size_t, char **, size_t *);
+
+#endif /* GZIP_H */
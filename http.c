@@ -1,30 +1,43 @@
 /* See LICENSE file for copyright and license details. */
 #include <arpa/inet.h>
-#include <ctype.h>
 #include <errno.h>
 #include <limits.h>
 #include <netinet/in.h>
-#include <regex.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "data.h"
+#include "dirl.h"
+#include "escape.h"
+#include "fdcache.h"
 #include "http.h"
+#include "map.h"
+#include "mime.h"
+#include "stats.h"
 #include "util.h"
+#include "vhost.h"
 
 const char *req_field_str[] = {
 	[REQ_HOST]              = "Host",
 	[REQ_RANGE]             = "Range",
 	[REQ_IF_MODIFIED_SINCE] = "If-Modified-Since",
+	[REQ_CONNECTION]        = "Connection",
+	[REQ_ACCEPT_ENCODING]   = "Accept-Encoding",
+	[REQ_IF_NONE_MATCH]     = "If-None-Match",
+	[REQ_REFERER]           = "Referer",
+	[REQ_USER_AGENT]        = "User-Agent",
 };
 
 const char *req_method_str[] = {
@@ -32,6 +45,11 @@ const char *req_method_str[] = {
 	[M_HEAD] = "HEAD",
 };
 
+const char *req_version_str[] = {
+	[V_1_0] = "1.0",
+	[V_1_1] = "1.1",
+};
+
 const char *status_str[] = {
 	[S_OK]                    = "OK",
 	[S_PARTIAL_CONTENT]       = "Partial Content",
@@ -56,120 +74,217 @@ const char *res_field_str[] = {
 	[RES_CONTENT_LENGTH] = "Content-Length",
 	[RES_CONTENT_RANGE]  = "Content-Range",
 	[RES_CONTENT_TYPE]   = "Content-Type",
+	[RES_TRANSFER_ENCODING] = "Transfer-Encoding",
+	[RES_CONTENT_ENCODING]  = "Content-Encoding",
+	[RES_VARY]              = "Vary",
+	[RES_ETAG]              = "ETag",
 };
 
-enum status (* const body_fct[])(int, const struct response *) = {
-	[RESTYPE_ERROR]      = data_send_error,
-	[RESTYPE_FILE]       = data_send_file,
-	[RESTYPE_DIRLISTING] = data_send_dirlisting,
+const char *encoding_str[] = {
+	[ENC_IDENTITY] = "identity",
+	[ENC_GZIP]     = "gzip",
+	[ENC_DEFLATE]  = "deflate",
 };
 
-enum status
-http_send_header(int fd, const struct response *res)
+/* the value of the Date field, formatted once a second */
+static const char *
+http_date(void)
 {
-	char t[FIELD_MAX];
-	size_t i;
+	static char date[sizeof("Thu, 01 Jan 1970 00:00:00 GMT")];
+	static time_t last = -1;
+	time_t now = time(NULL);
 
-	if (timestamp(t, sizeof(t), time(NULL))) {
-		return S_INTERNAL_SERVER_ERROR;
+	if (now != last) {
+		if (timestamp(date, sizeof(date), now)) {
+			return NULL;
+		}
+		last = now;
 	}
 
-	if (dprintf(fd,
-	            "HTTP/1.1 %d %s\r\n"
-	            "Date: %s\r\n"
-	            "Connection: close\r\n",
-	            res->status, status_str[res->status], t) < 0) {
-		return S_REQUEST_TIMEOUT;
-	}
+	return date;
+}
 
-	for (i = 0; i < NUM_RES_FIELDS; i++) {
-		if (res->field[i][0] != '\0') {
-			if (dprintf(fd, "%s: %s\r\n", res_field_str[i],
-			            res->field[i]) < 0) {
-				return S_REQUEST_TIMEOUT;
-			}
-		}
+/*
+ * the start of a response header, up to the Date, serialized once for
+ * each status, Connection and Content-Type seen
+ */
+static struct header_prefix {
+	enum status status;  /* 0 if the slot is unused */
+	int keepalive;
+	char type[FIELD_MAX];
+	char data[FIELD_MAX + 128];
+	size_t len;
+} prefixes[HEADER_PREFIXES];
+
+static int
+buffer_appends(struct buffer *buf, const char *s)
+{
+	return buffer_append(buf, s, strlen(s));
+}
+
+static const struct header_prefix *
+header_prefix(const struct response *res)
+{
+	struct header_prefix *p;
+	const char *type = res->field[RES_CONTENT_TYPE], *s;
+	size_t h = 5381 + res->status * 2 + !!res->keepalive;
+
+	for (s = type; *s; s++) {
+		h = h * 33 + (unsigned char)*s;
+	}
+	p = &prefixes[h % LEN(prefixes)];
+	if (p->status == res->status && p->keepalive == !!res->keepalive &&
+	    !strcmp(p->type, type)) {
+		return p;
 	}
 
-	if (dprintf(fd, "\r\n") < 0) {
-		return S_REQUEST_TIMEOUT;
+	/* take the slot over, unused until it is filled */
+	p->status = 0;
+	if (esnprintf(p->data, sizeof(p->data),
+	              "HTTP/1.1 %d %s\r\nConnection: %s\r\n%s%s%s",
+	              res->status, status_str[res->status],
+	              res->keepalive ? "keep-alive" : "close",
+	              type[0] ? "Content-Type: " : "", type,
+	              type[0] ? "\r\n" : "")) {
+		return NULL;
 	}
+	p->len = strlen(p->data);
+	p->keepalive = !!res->keepalive;
+	memcpy(p->type, type, sizeof(p->type));
+	p->status = res->status;
 
-	return 0;
+	return p;
 }
 
-static void
-decode(const char src[PATH_MAX], char dest[PATH_MAX])
+enum status
+http_prepare_header_buf(const struct response *res, struct buffer *buf)
 {
+	const struct header_prefix *p;
+	const char *date;
 	size_t i;
-	uint8_t n;
-	const char *s;
 
-	for (s = src, i = 0; *s; s++, i++) {
-		if (*s == '%' && (sscanf(s + 1, "%2hhx", &n) == 1)) {
-			dest[i] = n;
-			s += 2;
-		} else {
-			dest[i] = *s;
+	buf->len = 0;
+
+	/* write data, the Content-Type went with the prefix */
+	if (!(date = http_date()) || !(p = header_prefix(res)) ||
+	    buffer_append(buf, p->data, p->len) ||
+	    buffer_appends(buf, "Date: ") ||
+	    buffer_appends(buf, date) ||
+	    buffer_append(buf, "\r\n", 2)) {
+		goto err;
+	}
+
+	for (i = 0; i < NUM_RES_FIELDS; i++) {
+		if (i != RES_CONTENT_TYPE && res->field[i][0] != '\0' &&
+		    (buffer_appends(buf, res_field_str[i]) ||
+		     buffer_append(buf, ": ", 2) ||
+		     buffer_appends(buf, res->field[i]) ||
+		     buffer_append(buf, "\r\n", 2))) {
+			goto err;
 		}
 	}
-	dest[i] = '\0';
+
+	if (buffer_append(buf, "\r\n", 2)) {
+		goto err;
+	}
+
+	return 0;
+err:
+	buf->len = 0;
+	return S_INTERNAL_SERVER_ERROR;
 }
 
+/*
+ * send what is left in buf, followed by data[*off..len) if data is
+ * given, gathered into as few segments as possible. With more set,
+ * the kernel holds back a partial segment for what comes next.
+ */
 enum status
-http_recv_header(int fd, char *h, size_t hsiz, size_t *off)
+http_send_buf(int fd, struct buffer *buf, const char *data, size_t len,
+              size_t *off, int more)
 {
+	struct iovec iov[2];
+	struct msghdr msg = { .msg_iov = iov };
 	ssize_t r;
+	size_t n;
 
-	if (h == NULL || off == NULL || *off > hsiz) {
+	if (buf == NULL) {
 		return S_INTERNAL_SERVER_ERROR;
 	}
 
-	while (1) {
-		if ((r = read(fd, h + *off, hsiz - *off)) <= 0) {
+	while (buf->len > 0 || (data && *off < len)) {
+		msg.msg_iovlen = 0;
+		if (buf->len > 0) {
+			iov[msg.msg_iovlen].iov_base = buf->data;
+			iov[msg.msg_iovlen++].iov_len = buf->len;
+		}
+		if (data && *off < len) {
+			iov[msg.msg_iovlen].iov_base = (char *)data + *off;
+			iov[msg.msg_iovlen++].iov_len = len - *off;
+		}
+		if ((r = sendmsg(fd, &msg, MSG_NOSIGNAL |
+		                 (more ? MSG_MORE : 0))) <= 0) {
+			if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				/* socket is full, try again later */
+				return 0;
+			}
+			/* the peer is gone (EPIPE, ECONNRESET) or hung */
 			return S_REQUEST_TIMEOUT;
 		}
-		*off += r;
 
-		/* check if we are done (header terminated) */
-		if (*off >= 4 && !memcmp(h + *off - 4, "\r\n\r\n", 4)) {
-			break;
+		/* drop the sent bytes from the buffer, then the data */
+		buf->sent += r;
+		n = MIN((size_t)r, buf->len);
+		memmove(buf->data, buf->data + n, buf->len - n);
+		buf->len -= n;
+		if (data) {
+			*off += r - n;
 		}
+	}
 
-		/* buffer is full or read over, but header is not terminated */
-		if (r == 0 || *off == hsiz) {
-			return S_REQUEST_TOO_LARGE;
-		}
+	return 0;
+}
+
+enum status
+http_recv_header(int fd, char *h, size_t hsiz, size_t *len)
+{
+	ssize_t r;
+
+	if (h == NULL || len == NULL || *len > hsiz) {
+		return S_INTERNAL_SERVER_ERROR;
 	}
 
-	/* header is complete, remove last \r\n and null-terminate */
-	h[*off - 2] = '\0';
+	/* buffer is full, but header is not terminated */
+	if (*len == hsiz) {
+		return S_REQUEST_TOO_LARGE;
+	}
 
-	/* set *off to 0 to indicate we are finished */
-	*off = 0;
+	if ((r = read(fd, h + *len, hsiz - *len)) < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			/* no more data for now, try again later */
+			return 0;
+		}
+		return S_REQUEST_TIMEOUT;
+	} else if (r == 0) {
+		/* the client hung up before finishing the header */
+		return S_REQUEST_TIMEOUT;
+	}
+	*len += r;
 
 	return 0;
 }
 
-enum status
-http_parse_header(const char *h, struct request *req)
+static enum status
+parse_request_line(const char *p, const char *end, struct request *req)
 {
-	struct in6_addr addr;
+	const char *q;
 	size_t i, mlen;
-	const char *p, *q;
-	char *m, *n;
-
-	/* empty all fields */
-	memset(req, 0, sizeof(*req));
-
-	/*
-	 * parse request line
-	 */
 
 	/* METHOD */
 	for (i = 0; i < NUM_REQ_METHODS; i++) {
 		mlen = strlen(req_method_str[i]);
-		if (!strncmp(req_method_str[i], h, mlen)) {
+		if ((size_t)(end - p) >= mlen &&
+		    !memcmp(req_method_str[i], p, mlen)) {
 			req->method = i;
 			break;
 		}
@@ -179,15 +294,15 @@ http_parse_header(const char *h, struct request *req)
 	}
 
 	/* a single space must follow the method */
-	if (h[mlen] != ' ') {
+	if (p + mlen == end || p[mlen] != ' ') {
 		return S_BAD_REQUEST;
 	}
 
 	/* basis for next step */
-	p = h + mlen + 1;
+	p += mlen + 1;
 
 	/* TARGET */
-	if (!(q = strchr(p, ' '))) {
+	if (!(q = memchr(p, ' ', end - p))) {
 		return S_BAD_REQUEST;
 	}
 	if (q - p + 1 > PATH_MAX) {
@@ -195,74 +310,125 @@ http_parse_header(const char *h, struct request *req)
 	}
 	memcpy(req->uri, p, q - p);
 	req->uri[q - p] = '\0';
-	decode(req->uri, req->uri);
+	url_decode(req->uri, req->uri);
 
 	/* basis for next step */
 	p = q + 1;
 
 	/* HTTP-VERSION */
-	if (strncmp(p, "HTTP/", sizeof("HTTP/") - 1)) {
+	if (end - p < (ptrdiff_t)(sizeof("HTTP/") - 1) ||
+	    memcmp(p, "HTTP/", sizeof("HTTP/") - 1)) {
 		return S_BAD_REQUEST;
 	}
 	p += sizeof("HTTP/") - 1;
-	if (strncmp(p, "1.0", sizeof("1.0") - 1) &&
-	    strncmp(p, "1.1", sizeof("1.1") - 1)) {
+	for (i = 0; i < NUM_REQ_VERSIONS; i++) {
+		if (end - p >= (ptrdiff_t)(sizeof("1.*") - 1) &&
+		    !memcmp(p, req_version_str[i], sizeof("1.*") - 1)) {
+			req->version = i;
+			break;
+		}
+	}
+	if (i == NUM_REQ_VERSIONS) {
 		return S_VERSION_NOT_SUPPORTED;
 	}
 	p += sizeof("1.*") - 1;
 
-	/* check terminator */
-	if (strncmp(p, "\r\n", sizeof("\r\n") - 1)) {
-		return S_BAD_REQUEST;
+	/* nothing may follow the version */
+	return (p == end) ? 0 : S_BAD_REQUEST;
+}
+
+/* the field named by name[0..len), or NUM_REQ_FIELDS if we ignore it */
+static enum req_field
+field_index(const char *name, size_t len)
+{
+	enum req_field f;
+
+	/* the length and at most the first byte pick the candidate */
+	switch (len) {
+	case 4:  f = REQ_HOST;              break;
+	case 5:  f = REQ_RANGE;             break;
+	case 7:  f = REQ_REFERER;           break;
+	case 10:
+		f = (*name == 'U' || *name == 'u') ? REQ_USER_AGENT :
+		                                     REQ_CONNECTION;
+		break;
+	case 13: f = REQ_IF_NONE_MATCH;     break;
+	case 15: f = REQ_ACCEPT_ENCODING;   break;
+	case 17: f = REQ_IF_MODIFIED_SINCE; break;
+	default: return NUM_REQ_FIELDS;
 	}
 
-	/* basis for next step */
-	p += sizeof("\r\n") - 1;
+	return strncasecmp(name, req_field_str[f], len) ? NUM_REQ_FIELDS : f;
+}
 
-	/*
-	 * parse request-fields
-	 */
+static enum status
+parse_field(const char *p, const char *end, struct request *req)
+{
+	enum req_field f;
+	const char *q;
 
-	/* match field type */
-	for (; *p != '\0';) {
-		for (i = 0; i < NUM_REQ_FIELDS; i++) {
-			if (!strncasecmp(p, req_field_str[i],
-			                 strlen(req_field_str[i]))) {
-				break;
-			}
-		}
-		if (i == NUM_REQ_FIELDS) {
-			/* unmatched field, skip this line */
-			if (!(q = strstr(p, "\r\n"))) {
-				return S_BAD_REQUEST;
-			}
-			p = q + (sizeof("\r\n") - 1);
-			continue;
-		}
+	/* lines without a colon and unknown fields are skipped */
+	if (!(q = memchr(p, ':', end - p)) ||
+	    (f = field_index(p, q - p)) == NUM_REQ_FIELDS) {
+		return 0;
+	}
 
-		p += strlen(req_field_str[i]);
+	/* trim whitespace around the field content */
+	for (p = q + 1; p < end && (*p == ' ' || *p == '\t'); p++)
+		;
+	for (; end > p && (end[-1] == ' ' || end[-1] == '\t'); end--)
+		;
 
-		/* a single colon must follow the field name */
-		if (*p != ':') {
-			return S_BAD_REQUEST;
+	/* extract field content, what is only logged may be cut */
+	if (end - p + 1 > FIELD_MAX) {
+		if (f != REQ_REFERER && f != REQ_USER_AGENT) {
+			return S_REQUEST_TOO_LARGE;
 		}
+		end = p + FIELD_MAX - 1;
+	}
+	memcpy(req->field[f], p, end - p);
+	req->field[f][end - p] = '\0';
 
-		/* skip whitespace */
-		for (++p; *p == ' ' || *p == '\t'; p++)
-			;
+	return 0;
+}
+
+/*
+ * parse the complete lines in h[0..len) that haven't been parsed yet,
+ * so the header can be parsed while it arrives; when the empty line
+ * ending it has been parsed, p->done is set and p->off is its length
+ */
+enum status
+http_parse_header(struct parser *p, const char *h, size_t len,
+                  struct request *req)
+{
+	struct in6_addr addr;
+	enum status s;
+	const char *line, *end;
+	char *m, *n;
+
+	while (!p->done) {
+		line = h + p->off;
+		if (!(end = memchr(line, '\n', len - p->off))) {
+			/* wait for the rest of the line */
+			return 0;
+		}
 
-		/* extract field content */
-		if (!(q = strstr(p, "\r\n"))) {
+		/* lines end in "\r\n" */
+		if (end == line || end[-1] != '\r') {
 			return S_BAD_REQUEST;
 		}
-		if (q - p + 1 > FIELD_MAX) {
-			return S_REQUEST_TOO_LARGE;
+		if (p->off == 0) {
+			s = parse_request_line(line, end - 1, req);
+		} else if (end - 1 == line) {
+			p->done = 1;
+			s = 0;
+		} else {
+			s = parse_field(line, end - 1, req);
 		}
-		memcpy(req->field[i], p, q - p);
-		req->field[i][q - p] = '\0';
-
-		/* go to next line */
-		p = q + (sizeof("\r\n") - 1);
+		if (s) {
+			return s;
+		}
+		p->off = end + 1 - h;
 	}
 
 	/*
@@ -305,24 +471,6 @@ http_parse_header(const char *h, struct request *req)
 	return 0;
 }
 
-static void
-encode(const char src[PATH_MAX], char dest[PATH_MAX])
-{
-	size_t i;
-	const char *s;
-
-	for (s = src, i = 0; *s && i < (PATH_MAX - 4); s++) {
-		if (iscntrl(*s) || (unsigned char)*s > 127) {
-			i += snprintf(dest + i, PATH_MAX - i, "%%%02X",
-			              (unsigned char)*s);
-		} else {
-			dest[i] = *s;
-			i++;
-		}
-	}
-	dest[i] = '\0';
-}
-
 static int
 normabspath(char *path)
 {
@@ -377,25 +525,10 @@ squash:
 }
 
 static enum status
-parse_range(const char *str, size_t size, size_t *lower, size_t *upper)
+parse_range_spec(const char *p, size_t size, size_t *lower, size_t *upper)
 {
 	char first[FIELD_MAX], last[FIELD_MAX];
-	const char *p, *q, *r, *err;
-
-	/* default to the complete range */
-	*lower = 0;
-	*upper = size - 1;
-
-	/* done if no range-string is given */
-	if (str == NULL || *str == '\0') {
-		return 0;
-	}
-
-	/* skip opening statement */
-	if (strncmp(str, "bytes=", sizeof("bytes=") - 1)) {
-		return S_BAD_REQUEST;
-	}
-	p = str + (sizeof("bytes=") - 1);
+	const char *q, *r, *err;
 
 	/* check string (should only contain numbers and a hyphen) */
 	for (r = p, q = NULL; *r != '\0'; r++) {
@@ -408,13 +541,6 @@ parse_range(const char *str, size_t size, size_t *lower, size_t *upper)
 					/* place q after the hyphen */
 					q = r + 1;
 				}
-			} else if (*r == ',' && r > p) {
-				/*
-				 * we refuse to accept range-lists out
-				 * of spite towards this horrible part
-				 * of the spec
-				 */
-				return S_RANGE_NOT_SATISFIABLE;
 			} else {
 				return S_BAD_REQUEST;
 			}
@@ -450,10 +576,11 @@ parse_range(const char *str, size_t size, size_t *lower, size_t *upper)
 		 * last byte if 'last' is not given),
 		 * inclusively, and byte-numbering beginning at 0
 		 */
-		*lower = strtonum(first, 0, SIZE_MAX, &err);
+		*lower = strtonum(first, 0, MIN(SIZE_MAX, LLONG_MAX), &err);
 		if (!err) {
 			if (last[0] != '\0') {
-				*upper = strtonum(last, 0, SIZE_MAX, &err);
+				*upper = strtonum(last, 0,
+				                  MIN(SIZE_MAX, LLONG_MAX), &err);
 			} else {
 				*upper = size - 1;
 			}
@@ -485,7 +612,7 @@ parse_range(const char *str, size_t size, size_t *lower, size_t *upper)
 		 * use upper as a temporary storage for 'num',
 		 * as we know 'upper' is size - 1
 		 */
-		*upper = strtonum(last, 0, SIZE_MAX, &err);
+		*upper = strtonum(last, 0, MIN(SIZE_MAX, LLONG_MAX), &err);
 		if (err) {
 			return S_BAD_REQUEST;
 		}
@@ -505,6 +632,306 @@ parse_range(const char *str, size_t size, size_t *lower, size_t *upper)
 	return 0;
 }
 
+static int
+compare_range(const void *a, const void *b)
+{
+	const struct range *r1 = a, *r2 = b;
+
+	return (r1->lower > r2->lower) - (r1->lower < r2->lower);
+}
+
+/*
+ * parse a range-list into at most RANGES_MAX ranges, sorted and with
+ * overlapping or adjacent ones merged; no ranges at all stands for
+ * the complete file, which is also what longer lists get
+ */
+static enum status
+parse_range(const char *str, size_t size, struct range *range,
+            size_t *nrange)
+{
+	enum status s;
+	char spec[FIELD_MAX];
+	const char *p;
+	size_t len, i, n = 0;
+	int unsatisfiable = 0;
+
+	*nrange = 0;
+
+	/* done if no range-string is given */
+	if (str == NULL || *str == '\0') {
+		return 0;
+	}
+
+	/* skip opening statement */
+	if (strncmp(str, "bytes=", sizeof("bytes=") - 1)) {
+		return S_BAD_REQUEST;
+	}
+	p = str + (sizeof("bytes=") - 1);
+
+	for (;;) {
+		for (; *p == ' ' || *p == '\t' || *p == ','; p++)
+			;
+		if (*p == '\0') {
+			break;
+		}
+		if (n == RANGES_MAX) {
+			/* too many to be worth it, send it all */
+			return 0;
+		}
+		for (len = 0; p[len] != '\0' && p[len] != ',' &&
+		     p[len] != ' ' && p[len] != '\t'; len++)
+			;
+		if (len >= sizeof(spec)) {
+			return S_REQUEST_TOO_LARGE;
+		}
+		memcpy(spec, p, len);
+		spec[len] = '\0';
+		p += len;
+
+		/* a list is satisfiable if any of its ranges is */
+		if ((s = parse_range_spec(spec, size, &range[n].lower,
+		                          &range[n].upper))) {
+			if (s != S_RANGE_NOT_SATISFIABLE) {
+				return s;
+			}
+			unsatisfiable = 1;
+			continue;
+		}
+		n++;
+	}
+	if (n == 0) {
+		return unsatisfiable ? S_RANGE_NOT_SATISFIABLE : S_BAD_REQUEST;
+	}
+
+	qsort(range, n, sizeof(*range), compare_range);
+	for (i = 1, *nrange = 1; i < n; i++) {
+		if (range[i].lower <= range[*nrange - 1].upper + 1) {
+			range[*nrange - 1].upper = MAX(range[*nrange - 1].upper,
+			                               range[i].upper);
+		} else {
+			range[(*nrange)++] = range[i];
+		}
+	}
+
+	return 0;
+}
+
+/* set on nearly every response, so it is formatted by hand */
+static void
+content_length(struct response *res, size_t n)
+{
+	char digits[3 * sizeof(n)], *p = digits + sizeof(digits);
+	size_t len;
+
+	do {
+		*--p = '0' + n % 10;
+	} while (n /= 10);
+	len = digits + sizeof(digits) - p;
+	memcpy(res->field[RES_CONTENT_LENGTH], p, len);
+	res->field[RES_CONTENT_LENGTH][len] = '\0';
+}
+
+/* pick the content coding the client prefers, as far as we have it */
+static enum encoding
+accept_encoding(const char *s)
+{
+	enum encoding enc, best = ENC_IDENTITY;
+	double q, bestq = 0;
+	size_t len;
+	const char *p;
+
+	while (*s != '\0') {
+		for (; *s == ' ' || *s == '\t' || *s == ','; s++)
+			;
+		for (len = 0; s[len] != '\0' && s[len] != ',' &&
+		     s[len] != ';' && s[len] != ' ' && s[len] != '\t'; len++)
+			;
+
+		/* a weight of 0 means "not acceptable" */
+		q = 1;
+		for (p = s + len; *p != '\0' && *p != ','; p++) {
+			if (*p == ';') {
+				for (p++; *p == ' ' || *p == '\t'; p++)
+					;
+				if ((*p == 'q' || *p == 'Q') && p[1] == '=') {
+					q = strtod(p + 2, NULL);
+				}
+			}
+		}
+
+		for (enc = ENC_GZIP; enc < NUM_ENCODINGS; enc++) {
+			if ((len == 1 && *s == '*') ||
+			    (len == strlen(encoding_str[enc]) &&
+			     !strncasecmp(s, encoding_str[enc], len))) {
+				/* on a tie, gzip is the preferred one */
+				if (q > 0 && (q > bestq ||
+				    (q == bestq && enc < best))) {
+					best = enc;
+					bestq = q;
+				}
+				if (len == 1) {
+					/* prefer gzip for the wildcard */
+					break;
+				}
+			}
+		}
+		s = p;
+	}
+
+	return best;
+}
+
+static int
+compressible(const char *mime)
+{
+	size_t i;
+
+	for (i = 0; i < LEN(gzip_types); i++) {
+		if (!strncmp(mime, gzip_types[i], strlen(gzip_types[i]))) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+set_encoding(struct response *res, enum encoding enc)
+{
+	/* whatever we send, it depends on what the client accepts */
+	if (esnprintf(res->field[RES_VARY], sizeof(res->field[RES_VARY]),
+	              "%s", "Accept-Encoding")) {
+		return 1;
+	}
+	if (enc != ENC_IDENTITY &&
+	    esnprintf(res->field[RES_CONTENT_ENCODING],
+	              sizeof(res->field[RES_CONTENT_ENCODING]),
+	              "%s", encoding_str[enc])) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * find a precompressed ".gz" sibling of path that is not older than
+ * the file itself, it is returned in gzpath and gzst
+ */
+static int
+gzip_sidecar(const char *path, const struct stat *st, char *gzpath,
+             struct stat *gzst)
+{
+	if (esnprintf(gzpath, PATH_MAX, "%s.gz", path) ||
+	    fdcache_stat(gzpath, gzst) < 0 || !S_ISREG(gzst->st_mode) ||
+	    gzst->st_mtim.tv_sec < st->st_mtim.tv_sec ||
+	    (gzst->st_mtim.tv_sec == st->st_mtim.tv_sec &&
+	     gzst->st_mtim.tv_nsec < st->st_mtim.tv_nsec)) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * strong entity tag of a file: inode, size and nanosecond mtime, with
+ * the content coding appended as compressed bodies differ bytewise; a
+ * body sent from the precompressed sibling side changes with either
+ * file, so it is tagged by both
+ */
+static int
+etag(char *dst, size_t siz, const struct stat *st, const struct stat *side,
+     enum encoding enc)
+{
+	if (side) {
+		return esnprintf(dst, siz, "\"%jx-%jx.%lx-%jx-%jx-%jx.%lx-%s\"",
+		                 (uintmax_t)st->st_ino,
+		                 (intmax_t)st->st_mtim.tv_sec,
+		                 st->st_mtim.tv_nsec, (uintmax_t)side->st_ino,
+		                 (intmax_t)side->st_size,
+		                 (intmax_t)side->st_mtim.tv_sec,
+		                 side->st_mtim.tv_nsec, encoding_str[enc]);
+	}
+
+	return esnprintf(dst, siz, "\"%jx-%jx-%jx.%lx%s%s\"",
+	                 (uintmax_t)st->st_ino, (intmax_t)st->st_size,
+	                 (intmax_t)st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+	                 (enc != ENC_IDENTITY) ? "-" : "",
+	                 (enc != ENC_IDENTITY) ? encoding_str[enc] : "");
+}
+
+/* match tag against an If-None-Match list, comparing weakly */
+static int
+etag_match(const char *s, const char *tag)
+{
+	size_t len;
+
+	if (!strncmp(tag, "W/", sizeof("W/") - 1)) {
+		tag += sizeof("W/") - 1;
+	}
+	len = strlen(tag);
+
+	while (*s != '\0') {
+		for (; *s == ' ' || *s == '\t' || *s == ','; s++)
+			;
+		if (*s == '*') {
+			return 1;
+		}
+		if (!strncmp(s, "W/", sizeof("W/") - 1)) {
+			s += sizeof("W/") - 1;
+		}
+		if (!strncmp(s, tag, len) && (s[len] == '\0' ||
+		    s[len] == ',' || s[len] == ' ' || s[len] == '\t')) {
+			return 1;
+		}
+		for (; *s != '\0' && *s != ','; s++)
+			;
+	}
+
+	return 0;
+}
+
+/* weak entity tag of a listing, from its validator */
+static int
+listing_etag(char *dst, size_t siz, uint64_t v, enum encoding enc)
+{
+	return esnprintf(dst, siz, "W/\"%016jx%s%s\"", (uintmax_t)v,
+	                 (enc != ENC_IDENTITY) ? "-" : "",
+	                 (enc != ENC_IDENTITY) ? encoding_str[enc] : "");
+}
+
+/*
+ * match If-None-Match against the tag in res, of the body in coding
+ * *enc, and against ctag, of the body in coding cenc the client may
+ * hold instead; the tag and coding matched are left behind
+ */
+static int
+none_match(const char *list, struct response *res, enum encoding *enc,
+           const char *ctag, enum encoding cenc)
+{
+	if (cenc != *enc && etag_match(list, ctag)) {
+		memcpy(res->field[RES_ETAG], ctag, FIELD_MAX);
+		*enc = cenc;
+		return 1;
+	}
+
+	return etag_match(list, res->field[RES_ETAG]);
+}
+
+/* S_NOT_MODIFIED if nothing changed after the If-Modified-Since date */
+static enum status
+modified_since(const char *date, time_t mtime)
+{
+	struct tm tm = { 0 };
+
+	/* parse field */
+	if (!strptime(date, "%a, %d %b %Y %T GMT", &tm)) {
+		return S_BAD_REQUEST;
+	}
+
+	/* compare with last modification date */
+	return (difftime(mtime, timegm(&tm)) <= 0) ? S_NOT_MODIFIED : 0;
+}
+
 #undef RELPATH
 #define RELPATH(x) ((!*(x) || !strcmp(x, "/")) ? "." : ((x) + 1))
 
@@ -513,18 +940,23 @@ http_prepare_response(const struct request *req, struct response *res,
                       const struct server *srv)
 {
 	enum status s;
+	enum encoding enc, cenc;
 	struct in6_addr addr;
-	struct stat st;
-	struct tm tm = { 0 };
+	struct stat st, gzst;
+	const struct stat *side = NULL;
 	struct vhost *vhost;
-	size_t len, i;
-	int hasport, ipv6host;
+	const struct map *map;
+	uint64_t v, rnd;
+	time_t mtime;
+	size_t len, tolen;
+	int hasport, ipv6host, streamed, sidecar, varies;
 	static char realuri[PATH_MAX], tmpuri[PATH_MAX];
-	char *p, *mime;
-	const char *targethost;
+	char tag[FIELD_MAX];
+	const char *mime, *targethost;
 
 	/* empty all response fields */
 	memset(res, 0, sizeof(*res));
+	res->file.fd = -1;
 
 	/* make a working copy of the URI and normalize it */
 	memcpy(realuri, req->uri, sizeof(realuri));
@@ -536,15 +968,7 @@ http_prepare_response(const struct request *req, struct response *res,
 	/* match vhost */
 	vhost = NULL;
 	if (srv->vhost) {
-		for (i = 0; i < srv->vhost_len; i++) {
-			if (!regexec(&(srv->vhost[i].re), req->field[REQ_HOST],
-			             0, NULL, 0)) {
-				/* we have a matching vhost */
-				vhost = &(srv->vhost[i]);
-				break;
-			}
-		}
-		if (i == srv->vhost_len) {
+		if (!(vhost = vhost_match(srv, req->field[REQ_HOST]))) {
 			s = S_NOT_FOUND;
 			goto err;
 		}
@@ -557,25 +981,43 @@ http_prepare_response(const struct request *req, struct response *res,
 		}
 	}
 
-	/* apply URI prefix mapping */
-	for (i = 0; i < srv->map_len; i++) {
-		len = strlen(srv->map[i].from);
-		if (!strncmp(realuri, srv->map[i].from, len)) {
-			/* match canonical host if vhosts are enabled and
-			 * the mapping specifies a canonical host */
-			if (srv->vhost && srv->map[i].chost &&
-			    strcmp(srv->map[i].chost, vhost->chost)) {
-				continue;
-			}
+	/* the metrics are served from memory, on their vhost only */
+	if (srv->metrics && !strcmp(req->uri, srv->metrics) &&
+	    (!vhost || !strcmp(vhost->chost, srv->metricshost))) {
+		if (stats_print(&res->body.data, &res->body.len)) {
+			s = S_INTERNAL_SERVER_ERROR;
+			goto err;
+		}
+		res->type = RESTYPE_FILE;
+		res->status = S_OK;
+		if (esnprintf(res->field[RES_CONTENT_TYPE],
+		              sizeof(res->field[RES_CONTENT_TYPE]), "%s",
+		              "text/plain; version=0.0.4; charset=utf-8")) {
+			data_release(res);
+			s = S_INTERNAL_SERVER_ERROR;
+			goto err;
+		}
+		content_length(res, res->body.len);
 
-			/* swap out URI prefix */
-			memmove(realuri, realuri + len, strlen(realuri) + 1);
-			if (prepend(realuri, LEN(realuri), srv->map[i].to)) {
-				s = S_REQUEST_TOO_LARGE;
-				goto err;
-			}
-			break;
+		return;
+	}
+
+	/*
+	 * apply URI prefix mapping, matching the canonical host if vhosts
+	 * are enabled and the mapping specifies a canonical host
+	 */
+	if (srv->map && (map = map_match(srv, realuri, vhost ?
+	                                 vhost->chost : NULL))) {
+		/* swap out URI prefix in place */
+		len = strlen(map->from);
+		tolen = strlen(map->to);
+		if (strlen(realuri) - len + tolen + 1 > sizeof(realuri)) {
+			s = S_REQUEST_TOO_LARGE;
+			goto err;
 		}
+		memmove(realuri + tolen, realuri + len,
+		        strlen(realuri + len) + 1);
+		memcpy(realuri, map->to, tolen);
 	}
 
 	/* normalize URI again, in case we introduced dirt */
@@ -585,7 +1027,7 @@ http_prepare_response(const struct request *req, struct response *res,
 	}
 
 	/* stat the relative path derived from the URI */
-	if (stat(RELPATH(realuri), &st) < 0) {
+	if (fdcache_stat(RELPATH(realuri), &st) < 0) {
 		s = (errno == EACCES) ? S_FORBIDDEN : S_NOT_FOUND;
 		goto err;
 	}
@@ -622,7 +1064,7 @@ http_prepare_response(const struct request *req, struct response *res,
 		res->status = S_MOVED_PERMANENTLY;
 
 		/* encode realuri */
-		encode(realuri, tmpuri);
+		url_encode(realuri, tmpuri, sizeof(tmpuri));
 
 		/* determine target location */
 		if (srv->vhost) {
@@ -664,6 +1106,8 @@ http_prepare_response(const struct request *req, struct response *res,
 			}
 		}
 
+		content_length(res, data_error_len(res));
+
 		return;
 	} else {
 		/*
@@ -695,12 +1139,16 @@ http_prepare_response(const struct request *req, struct response *res,
 		}
 
 		/* stat the docindex, which must be a regular file */
-		if (stat(RELPATH(tmpuri), &st) < 0 || !S_ISREG(st.st_mode)) {
+		if (fdcache_stat(RELPATH(tmpuri), &st) < 0 ||
+		    !S_ISREG(st.st_mode)) {
 			if (srv->listdirs) {
 				/* serve directory listing */
+				if (access(res->path, R_OK)) {
+					s = S_FORBIDDEN;
+					goto err;
+				}
 				res->type = RESTYPE_DIRLISTING;
-				res->status = (access(res->path, R_OK)) ?
-				              S_FORBIDDEN : S_OK;
+				res->status = S_OK;
 
 				if (esnprintf(res->field[RES_CONTENT_TYPE],
 				              sizeof(res->field[RES_CONTENT_TYPE]),
@@ -709,6 +1157,89 @@ http_prepare_response(const struct request *req, struct response *res,
 					goto err;
 				}
 
+				/*
+				 * revalidate against the directory and the
+				 * templates, before any entry is read
+				 */
+				streamed = dirl_streamed(res->path);
+				enc = streamed ? ENC_IDENTITY : accept_encoding(
+				      req->field[REQ_ACCEPT_ENCODING]);
+				if (data_listing_validator(res, &v, &mtime) ||
+				    listing_etag(res->field[RES_ETAG],
+				                 sizeof(res->field[RES_ETAG]),
+				                 v, enc) ||
+				    timestamp(res->field[RES_LAST_MODIFIED],
+				              sizeof(res->field[RES_LAST_MODIFIED]),
+				              mtime)) {
+					s = S_INTERNAL_SERVER_ERROR;
+					goto err;
+				}
+				if (req->field[REQ_IF_NONE_MATCH][0]) {
+					if (listing_etag(tag, sizeof(tag), v,
+					                 ENC_IDENTITY)) {
+						s = S_INTERNAL_SERVER_ERROR;
+						goto err;
+					}
+					s = none_match(req->field[REQ_IF_NONE_MATCH],
+					               res, &enc, tag, ENC_IDENTITY) ?
+					    S_NOT_MODIFIED : 0;
+				} else if (req->field[REQ_IF_MODIFIED_SINCE][0]) {
+					s = modified_since(
+					    req->field[REQ_IF_MODIFIED_SINCE], mtime);
+				} else {
+					s = 0;
+				}
+				if (s == S_NOT_MODIFIED) {
+					res->status = S_NOT_MODIFIED;
+					if (!streamed && set_encoding(res, enc)) {
+						s = S_INTERNAL_SERVER_ERROR;
+						goto err;
+					}
+					return;
+				} else if (s) {
+					goto err;
+				}
+
+				/*
+				 * huge directories can opt in to be streamed
+				 * unsorted as they are read, in chunks if the
+				 * client understands them
+				 */
+				if (streamed) {
+					if ((s = data_open_dirstream(res,
+					     req->version == V_1_1))) {
+						goto err;
+					}
+					if (req->version == V_1_1 &&
+					    esnprintf(res->field[RES_TRANSFER_ENCODING],
+					              sizeof(res->field[RES_TRANSFER_ENCODING]),
+					              "%s", "chunked")) {
+						data_release(res);
+						s = S_INTERNAL_SERVER_ERROR;
+						goto err;
+					}
+
+					return;
+				}
+
+				/*
+				 * render the listing up front, so its length
+				 * is known and the connection can persist
+				 */
+				if ((s = data_render_dirlisting(res, srv->cache,
+				                                &enc))) {
+					goto err;
+				}
+				if (set_encoding(res, enc) ||
+				    listing_etag(res->field[RES_ETAG],
+				                 sizeof(res->field[RES_ETAG]),
+				                 v, enc)) {
+					data_release(res);
+					s = S_INTERNAL_SERVER_ERROR;
+					goto err;
+				}
+				content_length(res, res->body.len);
+
 				return;
 			} else {
 				/* reject */
@@ -719,25 +1250,80 @@ http_prepare_response(const struct request *req, struct response *res,
 		}
 	}
 
-	/* modified since */
-	if (req->field[REQ_IF_MODIFIED_SINCE][0]) {
-		/* parse field */
-		if (!strptime(req->field[REQ_IF_MODIFIED_SINCE],
-		              "%a, %d %b %Y %T GMT", &tm)) {
-			s = S_BAD_REQUEST;
+	/* mime */
+	if (!(mime = mime_type(realuri))) {
+		mime = "application/octet-stream";
+	}
+
+	/*
+	 * a precompressed sibling costs nothing to send, and ranges
+	 * refer to it as the representation actually served; its size
+	 * is taken over and it is validated along with the file, which
+	 * it is never older than
+	 */
+	enc = ENC_IDENTITY;
+	mtime = st.st_mtim.tv_sec;
+	sidecar = !gzip_sidecar(res->path, &st, tmpuri, &gzst);
+	if (sidecar &&
+	    accept_encoding(req->field[REQ_ACCEPT_ENCODING]) == ENC_GZIP) {
+		memcpy(res->path, tmpuri, sizeof(res->path));
+		st.st_size = gzst.st_size;
+		mtime = gzst.st_mtim.tv_sec;
+		side = &gzst;
+		enc = ENC_GZIP;
+	}
+
+	/*
+	 * wherever a compressed variant could be picked, whatever is sent
+	 * depends on what the client accepts
+	 */
+	varies = sidecar || compressible(mime);
+
+	/* entity tag of the file, or of its precompressed sibling */
+	if (etag(res->field[RES_ETAG], sizeof(res->field[RES_ETAG]), &st,
+	         side, enc)) {
+		s = S_INTERNAL_SERVER_ERROR;
+		goto err;
+	}
+
+	/* none match, which takes precedence over modified since */
+	if (req->field[REQ_IF_NONE_MATCH][0]) {
+		/*
+		 * the client may also hold the body in the coding it
+		 * would be compressed in on the fly
+		 */
+		cenc = enc;
+		if (enc == ENC_IDENTITY && compressible(mime) &&
+		    req->field[REQ_RANGE][0] == '\0' &&
+		    st.st_size <= GZIP_MAX) {
+			cenc = accept_encoding(req->field[REQ_ACCEPT_ENCODING]);
+		}
+		if (etag(tag, sizeof(tag), &st, side, cenc)) {
+			s = S_INTERNAL_SERVER_ERROR;
 			goto err;
 		}
-
-		/* compare with last modification date of the file */
-		if (difftime(st.st_mtim.tv_sec, timegm(&tm)) <= 0) {
-			res->status = S_NOT_MODIFIED;
-			return;
+		s = none_match(req->field[REQ_IF_NONE_MATCH], res, &enc,
+		               tag, cenc) ? S_NOT_MODIFIED : 0;
+	} else if (req->field[REQ_IF_MODIFIED_SINCE][0]) {
+		s = modified_since(req->field[REQ_IF_MODIFIED_SINCE], mtime);
+	} else {
+		s = 0;
+	}
+	if (s == S_NOT_MODIFIED) {
+		/* the file is not even opened */
+		res->status = S_NOT_MODIFIED;
+		if (varies && set_encoding(res, enc)) {
+			s = S_INTERNAL_SERVER_ERROR;
+			goto err;
 		}
+		return;
+	} else if (s) {
+		goto err;
 	}
 
 	/* range */
 	if ((s = parse_range(req->field[REQ_RANGE], st.st_size,
-	                     &(res->file.lower), &(res->file.upper)))) {
+	                     res->file.range, &(res->file.nrange)))) {
 		if (s == S_RANGE_NOT_SATISFIABLE) {
 			res->status = S_RANGE_NOT_SATISFIABLE;
 
@@ -747,63 +1333,108 @@ http_prepare_response(const struct request *req, struct response *res,
 				s = S_INTERNAL_SERVER_ERROR;
 				goto err;
 			}
+			content_length(res, data_error_len(res));
 
 			return;
 		} else {
 			goto err;
 		}
 	}
-
-	/* mime */
-	mime = "application/octet-stream";
-	if ((p = strrchr(realuri, '.'))) {
-		for (i = 0; i < LEN(mimes); i++) {
-			if (!strcmp(mimes[i].ext, p + 1)) {
-				mime = mimes[i].type;
-				break;
-			}
-		}
-	}
+	res->file.lower = res->file.nrange ? res->file.range[0].lower : 0;
+	res->file.upper = res->file.nrange ? res->file.range[0].upper :
+	                  (size_t)st.st_size - 1;
+	res->file.size = st.st_size;
 
 	/* fill response struct */
 	res->type = RESTYPE_FILE;
 
-	/* check if file is readable */
-	res->status = (access(res->path, R_OK)) ? S_FORBIDDEN :
-	              (req->field[REQ_RANGE][0] != '\0') ?
-	              S_PARTIAL_CONTENT : S_OK;
+	/* check if file is readable, a hot one is already open */
+	res->file.fe = fdcache_acquire(res->path, &(res->file.fd));
+	if (!res->file.fe && access(res->path, R_OK)) {
+		/* the error response has a body of its own */
+		s = S_FORBIDDEN;
+		goto err;
+	}
+	res->status = res->file.nrange ? S_PARTIAL_CONTENT : S_OK;
 
 	if (esnprintf(res->field[RES_ACCEPT_RANGES],
 	              sizeof(res->field[RES_ACCEPT_RANGES]),
 		      "%s", "bytes")) {
+		data_release(res);
 		s = S_INTERNAL_SERVER_ERROR;
 		goto err;
 	}
 
-	if (esnprintf(res->field[RES_CONTENT_LENGTH],
-	              sizeof(res->field[RES_CONTENT_LENGTH]),
-	              "%zu", res->file.upper - res->file.lower + 1)) {
+	/*
+	 * otherwise compress text that is not too large, unless a range
+	 * of it was asked for
+	 */
+	if (enc == ENC_IDENTITY && compressible(mime)) {
+		enc = accept_encoding(req->field[REQ_ACCEPT_ENCODING]);
+		if (res->status != S_OK || st.st_size > GZIP_MAX ||
+		    (enc != ENC_IDENTITY &&
+		     data_compress_file(res, &st, srv->cache, enc))) {
+			enc = ENC_IDENTITY;
+		}
+	}
+
+	/* small files are sent from memory, in one go with the header */
+	if (enc == ENC_IDENTITY && res->status == S_OK &&
+	    req->method == M_GET && srv->filecache &&
+	    st.st_size <= FILECACHE_MAX) {
+		data_load_file(res, &st, srv->filecache);
+	}
+
+	if (varies && (set_encoding(res, enc) ||
+	               etag(res->field[RES_ETAG], sizeof(res->field[RES_ETAG]),
+	                    &st, side, enc))) {
+		data_release(res);
 		s = S_INTERNAL_SERVER_ERROR;
 		goto err;
 	}
-	if (req->field[REQ_RANGE][0] != '\0') {
-		if (esnprintf(res->field[RES_CONTENT_RANGE],
-		              sizeof(res->field[RES_CONTENT_RANGE]),
-		              "bytes %zd-%zd/%zu", res->file.lower,
-			      res->file.upper, st.st_size)) {
+
+	if (res->file.nrange > 1) {
+		/* parts are framed by a boundary unlikely to be in the file */
+		if (getrandom(&rnd, sizeof(rnd), GRND_NONBLOCK) != sizeof(rnd)) {
+			rnd = ((uint64_t)getpid() << 32) ^ time(NULL) ^ st.st_ino;
+		}
+		if (esnprintf(res->file.boundary, sizeof(res->file.boundary),
+		              "%016jx", (uintmax_t)rnd) ||
+		    esnprintf(res->file.type, sizeof(res->file.type), "%s",
+		              mime) ||
+		    esnprintf(res->field[RES_CONTENT_TYPE],
+		              sizeof(res->field[RES_CONTENT_TYPE]),
+		              "multipart/byteranges; boundary=%s",
+		              res->file.boundary)) {
+			data_release(res);
+			s = S_INTERNAL_SERVER_ERROR;
+			goto err;
+		}
+		content_length(res, data_multipart_len(res));
+	} else {
+		content_length(res, res->body.data ? res->body.len :
+		               res->file.upper - res->file.lower + 1);
+		if (res->file.nrange == 1) {
+			if (esnprintf(res->field[RES_CONTENT_RANGE],
+			              sizeof(res->field[RES_CONTENT_RANGE]),
+			              "bytes %zd-%zd/%zu", res->file.lower,
+			              res->file.upper, st.st_size)) {
+				data_release(res);
+				s = S_INTERNAL_SERVER_ERROR;
+				goto err;
+			}
+		}
+		if (esnprintf(res->field[RES_CONTENT_TYPE],
+		              sizeof(res->field[RES_CONTENT_TYPE]),
+		              "%s", mime)) {
+			data_release(res);
 			s = S_INTERNAL_SERVER_ERROR;
 			goto err;
 		}
-	}
-	if (esnprintf(res->field[RES_CONTENT_TYPE],
-	              sizeof(res->field[RES_CONTENT_TYPE]),
-	              "%s", mime)) {
-		s = S_INTERNAL_SERVER_ERROR;
-		goto err;
 	}
 	if (timestamp(res->field[RES_LAST_MODIFIED],
-	              sizeof(res->field[RES_LAST_MODIFIED]),
-	              st.st_mtim.tv_sec)) {
+	              sizeof(res->field[RES_LAST_MODIFIED]), mtime)) {
+		data_release(res);
 		s = S_INTERNAL_SERVER_ERROR;
 		goto err;
 	}
@@ -822,6 +1453,7 @@ http_prepare_error_response(const struct request *req,
 
 	/* empty all response fields */
 	memset(res, 0, sizeof(*res));
+	res->file.fd = -1;
 
 	res->type = RESTYPE_ERROR;
 	res->status = s;
@@ -839,17 +1471,49 @@ http_prepare_error_response(const struct request *req,
 			res->status = S_INTERNAL_SERVER_ERROR;
 		}
 	}
+
+	/* error pages are generated in one go, so their length is known */
+	content_length(res, data_error_len(res));
 }
 
-enum status
-http_send_body(int fd, const struct response *res,
-               const struct request *req)
+static int
+has_token(const char *s, const char *tok)
 {
-	enum status s;
+	size_t len = strlen(tok);
 
-	if (req->method == M_GET && (s = body_fct[res->type](fd, res))) {
-		return s;
+	/* match tok against the comma-separated list s */
+	while (*s != '\0') {
+		for (; *s == ' ' || *s == '\t' || *s == ','; s++)
+			;
+		if (!strncasecmp(s, tok, len) && (s[len] == '\0' ||
+		    s[len] == ',' || s[len] == ' ' || s[len] == '\t')) {
+			return 1;
+		}
+		for (; *s != '\0' && *s != ','; s++)
+			;
 	}
 
 	return 0;
 }
+
+int
+http_has_body(const struct request *req, const struct response *res)
+{
+	return req->method == M_GET && res->status != S_NOT_MODIFIED;
+}
+
+int
+http_keepalive(const struct request *req, const struct response *res)
+{
+	/* HTTP/1.1 persists by default, HTTP/1.0 only on request */
+	if (req->version == V_1_1 ?
+	    has_token(req->field[REQ_CONNECTION], "close") :
+	    !has_token(req->field[REQ_CONNECTION], "keep-alive")) {
+		return 0;
+	}
+
+	/* the client must be able to tell where the body ends */
+	return !http_has_body(req, res) ||
+	       res->field[RES_CONTENT_LENGTH][0] != '\0' ||
+	       res->field[RES_TRANSFER_ENCODING][0] != '\0';
+}
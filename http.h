@@ -2,18 +2,24 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include <dirent.h>
 #include <limits.h>
-#include <sys/socket.h>
 
 #include "util.h"
 
 #define HEADER_MAX 4096
 #define FIELD_MAX 200
+#define RANGES_MAX 16
 
 enum req_field {
 	REQ_HOST,
 	REQ_RANGE,
 	REQ_IF_MODIFIED_SINCE,
+	REQ_CONNECTION,
+	REQ_ACCEPT_ENCODING,
+	REQ_IF_NONE_MATCH,
+	REQ_REFERER,
+	REQ_USER_AGENT,
 	NUM_REQ_FIELDS,
 };
 
@@ -27,12 +33,27 @@ enum req_method {
 
 extern const char *req_method_str[];
 
+enum req_version {
+	V_1_0,
+	V_1_1,
+	NUM_REQ_VERSIONS,
+};
+
+extern const char *req_version_str[];
+
 struct request {
 	enum req_method method;
+	enum req_version version;
 	char uri[PATH_MAX];
 	char field[NUM_REQ_FIELDS][FIELD_MAX];
 };
 
+/* progress in parsing a request header as it arrives */
+struct parser {
+	size_t off; /* length of the lines parsed */
+	int done;   /* the header is complete and off is its length */
+};
+
 enum status {
 	S_OK                    = 200,
 	S_PARTIAL_CONTENT       = 206,
@@ -59,11 +80,24 @@ enum res_field {
 	RES_CONTENT_LENGTH,
 	RES_CONTENT_RANGE,
 	RES_CONTENT_TYPE,
+	RES_TRANSFER_ENCODING,
+	RES_CONTENT_ENCODING,
+	RES_VARY,
+	RES_ETAG,
 	NUM_RES_FIELDS,
 };
 
 extern const char *res_field_str[];
 
+enum encoding {
+	ENC_IDENTITY,
+	ENC_GZIP,
+	ENC_DEFLATE,
+	NUM_ENCODINGS,
+};
+
+extern const char *encoding_str[];
+
 enum res_type {
 	RESTYPE_ERROR,
 	RESTYPE_FILE,
@@ -71,47 +105,66 @@ enum res_type {
 	NUM_RES_TYPES,
 };
 
+enum file_xfer {
+	XFER_SENDFILE,
+	XFER_SPLICE,
+	XFER_COPY,
+};
+
+struct fdcache_entry;
+
+struct range {
+	size_t lower;
+	size_t upper;
+};
+
 struct response {
 	enum res_type type;
 	enum status status;
+	int keepalive;
 	char field[NUM_RES_FIELDS][FIELD_MAX];
 	char uri[PATH_MAX];
 	char path[PATH_MAX];
 	struct {
 		size_t lower;
 		size_t upper;
+		int fd;
+		struct fdcache_entry *fe; /* fd is held in the cache */
+		enum file_xfer xfer;
+		int pipe[2];   /* used by XFER_SPLICE */
+		size_t inpipe; /* bytes waiting in the pipe */
+		/* multipart/byteranges, lower and upper bound the part */
+		struct range range[RANGES_MAX];
+		size_t nrange;
+		size_t part;   /* parts begun, nrange + 1 once closed */
+		size_t size;   /* of the whole file */
+		char boundary[17];
+		char type[FIELD_MAX];
 	} file;
+	struct {
+		char *data;
+		size_t len;
+	} body;        /* in memory, sent instead of a file or listing */
+	struct {
+		DIR *dir;    /* set when streaming, body holds one chunk */
+		int chunked; /* chunks are framed for HTTP/1.1 */
+		int started; /* header template was emitted */
+		int eof;     /* last chunk was rendered */
+	} dirlisting;
 };
 
-extern enum status (* const body_fct[])(int, const struct response *);
-
-enum conn_state {
-	C_VACANT,
-	C_RECV_HEADER,
-	C_SEND_HEADER,
-	C_SEND_BODY,
-	NUM_CONN_STATES,
-};
-
-struct connection {
-	enum conn_state state;
-	int fd;
-	struct sockaddr_storage ia;
-	char header[HEADER_MAX]; /* general req/res-header buffer */
-	size_t off;              /* general offset (header/file/dir) */
-	struct request req;
-	struct response res;
-};
-
-enum status http_send_header(int, const struct response *);
-enum status http_send_status(int, enum status);
+enum status http_prepare_header_buf(const struct response *,
+                                   struct buffer *);
+enum status http_send_buf(int, struct buffer *, const char *, size_t,
+                         size_t *, int);
 enum status http_recv_header(int, char *, size_t, size_t *);
-enum status http_parse_header(const char *, struct request *);
+enum status http_parse_header(struct parser *, const char *, size_t,
+                              struct request *);
 void http_prepare_response(const struct request *, struct response *,
                            const struct server *);
 void http_prepare_error_response(const struct request *,
                                  struct response *, enum status);
-enum status http_send_body(int, const struct response *,
-                           const struct request *);
+int http_keepalive(const struct request *, const struct response *);
+int http_has_body(const struct request *, const struct response *);
 
 #endif /* HTTP_H */
@@ -0,0 +1,612 @@
+/* See LICENSE file for copyright and license details. */
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "connection.h"
+#include "http.h"
+#include "logger.h"
+#include "sock.h"
+#include "util.h"
+
+/* longest line, longer ones are cut */
+#define LOGLINE_MAX 8192
+
+enum format {
+	F_TSV,
+	F_COMMON,
+	F_COMBINED,
+	F_JSON,
+	NUM_FORMATS,
+};
+
+static const char *format_str[] = {
+	[F_TSV]      = "tsv",
+	[F_COMMON]   = "common",
+	[F_COMBINED] = "combined",
+	[F_JSON]     = "json",
+};
+
+enum field {
+	L_TIME,
+	L_ADDR,
+	L_STATUS,
+	L_METHOD,
+	L_HOST,
+	L_URI,
+	L_BYTES,
+	L_DURATION,
+	L_RANGE,
+	L_REFERER,
+	L_AGENT,
+	NUM_FIELDS,
+	L_BODY = NUM_FIELDS, /* only in the common formats */
+};
+
+static const char *field_str[] = {
+	[L_TIME]     = "time",
+	[L_ADDR]     = "addr",
+	[L_STATUS]   = "status",
+	[L_METHOD]   = "method",
+	[L_HOST]     = "host",
+	[L_URI]      = "uri",
+	[L_BYTES]    = "bytes",
+	[L_DURATION] = "duration",
+	[L_RANGE]    = "range",
+	[L_REFERER]  = "referer",
+	[L_AGENT]    = "agent",
+};
+
+/* the fields of tsv and json lines, tsv defaults to the classic ones */
+static enum format format = F_TSV;
+static enum field field[NUM_FIELDS] = {
+	L_TIME, L_ADDR, L_STATUS, L_HOST, L_URI,
+};
+static size_t nfields = 5;
+
+/*
+ * head and tail count all bytes ever put into and taken out of data,
+ * so the lines waiting are data[tail..head) modulo size
+ */
+static struct ring {
+	pthread_mutex_t lock;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t seq;      /* lines offered while busy */
+	uint64_t sampled;  /* lines left out while busy */
+	uint64_t dropped;  /* lines that didn't fit */
+	size_t size;
+	char data[];
+} *ring;
+
+/* where lines go if there is no ring, and where the writer puts them */
+static int logfd = STDOUT_FILENO;
+
+static volatile sig_atomic_t stop;
+
+struct line {
+	char data[LOGLINE_MAX];
+	size_t len;
+};
+
+int
+logger_format(const char *spec)
+{
+	const char *p, *q;
+	size_t i, len = strcspn(spec, ":");
+
+	for (i = 0; i < NUM_FORMATS; i++) {
+		if (strlen(format_str[i]) == len &&
+		    !strncmp(format_str[i], spec, len)) {
+			break;
+		}
+	}
+	if (i == NUM_FORMATS) {
+		return 1;
+	}
+	format = i;
+
+	if (spec[len] == '\0') {
+		if (format == F_JSON) {
+			/* all fields */
+			for (nfields = 0; nfields < NUM_FIELDS; nfields++) {
+				field[nfields] = nfields;
+			}
+		}
+		return 0;
+	}
+
+	/* the common formats have a fixed layout */
+	if (format != F_TSV && format != F_JSON) {
+		return 1;
+	}
+	for (nfields = 0, p = spec + len + 1; ; p = q + 1) {
+		q = p + strcspn(p, ",");
+		for (i = 0; i < NUM_FIELDS; i++) {
+			if (strlen(field_str[i]) == (size_t)(q - p) &&
+			    !strncmp(field_str[i], p, q - p)) {
+				break;
+			}
+		}
+		if (i == NUM_FIELDS || nfields == NUM_FIELDS) {
+			return 1;
+		}
+		field[nfields++] = i;
+		if (*q == '\0') {
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static void
+putmem(struct line *l, const char *s, size_t len)
+{
+	len = MIN(len, sizeof(l->data) - 1 - l->len);
+	memcpy(l->data + l->len, s, len);
+	l->len += len;
+}
+
+static void
+putstr(struct line *l, const char *s)
+{
+	putmem(l, s, strlen(s));
+}
+
+static void
+putu(struct line *l, uintmax_t n)
+{
+	char digits[3 * sizeof(n)], *p = digits + sizeof(digits);
+
+	do {
+		*--p = '0' + n % 10;
+	} while (n /= 10);
+	putmem(l, p, digits + sizeof(digits) - p);
+}
+
+/*
+ * a value that can't break the line: control characters, quotes and
+ * backslashes are escaped the JSON way for json lines, else as \xHH
+ */
+static void
+putv(struct line *l, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	char esc[6];
+	size_t n;
+
+	for (; *s; s++) {
+		for (n = 0; s[n] && (unsigned char)s[n] >= 0x20 &&
+		     s[n] != 0x7f && s[n] != '"' && s[n] != '\\'; n++)
+			;
+		putmem(l, s, n);
+		if (!*(s += n)) {
+			break;
+		}
+		if (*s == '"' || *s == '\\') {
+			esc[0] = '\\';
+			esc[1] = *s;
+			putmem(l, esc, 2);
+		} else if (format == F_JSON) {
+			memcpy(esc, "\\u00", 4);
+			esc[4] = hex[(unsigned char)*s >> 4];
+			esc[5] = hex[*s & 0xf];
+			putmem(l, esc, 6);
+		} else {
+			memcpy(esc, "\\x", 2);
+			esc[2] = hex[(unsigned char)*s >> 4];
+			esc[3] = hex[*s & 0xf];
+			putmem(l, esc, 4);
+		}
+	}
+}
+
+/* the time of a line, formatted once a second */
+static const char *
+timestr(time_t t)
+{
+	static char buf[sizeof("01/Jan/1970:00:00:00 +0000")];
+	static time_t last = -1;
+	struct tm tm;
+
+	if (t != last) {
+		if (!gmtime_r(&t, &tm) || !strftime(buf, sizeof(buf),
+		    (format == F_COMMON || format == F_COMBINED) ?
+		    "%d/%b/%Y:%H:%M:%S +0000" : "%Y-%m-%dT%H:%M:%SZ", &tm)) {
+			return "-";
+		}
+		last = t;
+	}
+
+	return buf;
+}
+
+static void
+putfield(struct line *l, const struct connection *c, enum field f,
+         const struct timespec *end)
+{
+	char addr[INET6_ADDRSTRLEN /* > INET_ADDRSTRLEN */];
+	const struct timespec *start = c->start.tv_sec ? &c->start : end;
+	intmax_t us;
+
+	switch (f) {
+	case L_TIME:
+		putstr(l, timestr(start->tv_sec));
+		break;
+	case L_ADDR:
+		if (sock_get_inaddr_str(&c->ia, addr, LEN(addr))) {
+			addr[0] = '\0';
+		}
+		putstr(l, addr);
+		break;
+	case L_STATUS:
+		putu(l, c->res.status);
+		break;
+	case L_METHOD:
+		/* no method was seen if the request line didn't parse */
+		putstr(l, c->req.uri[0] ? req_method_str[c->req.method] : "");
+		break;
+	case L_HOST:
+		putv(l, c->req.field[REQ_HOST]);
+		break;
+	case L_URI:
+		putv(l, c->req.uri);
+		break;
+	case L_BYTES:
+		putu(l, c->buf.sent);
+		break;
+	case L_BODY:
+		/* the common formats count the body alone, "-" for none */
+		if (c->buf.sent > c->head) {
+			putu(l, c->buf.sent - c->head);
+		} else {
+			putstr(l, "-");
+		}
+		break;
+	case L_DURATION:
+		/* microseconds, as far as the clock didn't go back */
+		us = (intmax_t)(end->tv_sec - start->tv_sec) * 1000000 +
+		     (end->tv_nsec - start->tv_nsec) / 1000;
+		putu(l, MAX(us, 0));
+		break;
+	case L_RANGE:
+		putv(l, c->req.field[REQ_RANGE]);
+		break;
+	case L_REFERER:
+		putv(l, c->req.field[REQ_REFERER]);
+		break;
+	case L_AGENT:
+		putv(l, c->req.field[REQ_USER_AGENT]);
+		break;
+	default:
+		break;
+	}
+}
+
+static int
+numeric(enum field f)
+{
+	return f == L_STATUS || f == L_BYTES || f == L_DURATION;
+}
+
+static void
+format_line(struct line *l, const struct connection *c)
+{
+	struct timespec end;
+	size_t i;
+
+	clock_gettime(CLOCK_REALTIME, &end);
+	l->len = 0;
+
+	switch (format) {
+	case F_COMMON:
+	case F_COMBINED:
+		/* addr - - [time] "request line" status bytes */
+		putfield(l, c, L_ADDR, &end);
+		putstr(l, " - - [");
+		putfield(l, c, L_TIME, &end);
+		putstr(l, "] \"");
+		if (c->req.uri[0]) {
+			putfield(l, c, L_METHOD, &end);
+			putstr(l, " ");
+			putv(l, c->req.uri);
+			putstr(l, " HTTP/");
+			putstr(l, req_version_str[c->req.version]);
+		} else {
+			putstr(l, "-");
+		}
+		putstr(l, "\" ");
+		putfield(l, c, L_STATUS, &end);
+		putstr(l, " ");
+		putfield(l, c, L_BODY, &end);
+		if (format == F_COMBINED) {
+			/* "referer" "agent" */
+			putstr(l, " \"");
+			putv(l, c->req.field[REQ_REFERER][0] ?
+			     c->req.field[REQ_REFERER] : "-");
+			putstr(l, "\" \"");
+			putv(l, c->req.field[REQ_USER_AGENT][0] ?
+			     c->req.field[REQ_USER_AGENT] : "-");
+			putstr(l, "\"");
+		}
+		break;
+	case F_JSON:
+		putstr(l, "{");
+		for (i = 0; i < nfields; i++) {
+			putstr(l, i ? ",\"" : "\"");
+			putstr(l, field_str[field[i]]);
+			putstr(l, numeric(field[i]) ? "\":" : "\":\"");
+			putfield(l, c, field[i], &end);
+			if (!numeric(field[i])) {
+				putstr(l, "\"");
+			}
+		}
+		putstr(l, "}");
+		break;
+	case F_TSV:
+	default:
+		for (i = 0; i < nfields; i++) {
+			if (i) {
+				putstr(l, "\t");
+			}
+			putfield(l, c, field[i], &end);
+		}
+	}
+
+	/* the newline always fits */
+	l->data[l->len++] = '\n';
+}
+
+static int
+lock(void)
+{
+	switch (pthread_mutex_lock(&ring->lock)) {
+	case 0:
+		return 0;
+	case EOWNERDEAD:
+		/* head only moves past complete lines, nothing to repair */
+		pthread_mutex_consistent(&ring->lock);
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+static void
+unlock(void)
+{
+	pthread_mutex_unlock(&ring->lock);
+}
+
+void
+logger_log(const struct connection *c)
+{
+	struct line l;
+	size_t used, off, n;
+
+	format_line(&l, c);
+
+	if (!ring) {
+		/* a single write keeps lines of different processes apart */
+		if (write(logfd, l.data, l.len) < 0) {
+			warn("write:");
+		}
+		return;
+	}
+
+	if (lock()) {
+		return;
+	}
+	used = ring->head - ring->tail;
+	if (used + l.len > ring->size) {
+		ring->dropped++;
+	} else if (2 * used > ring->size && c->res.status < 500 &&
+	           ring->seq++ % LOG_SAMPLE) {
+		/* busy, keep one line in LOG_SAMPLE, and all errors */
+		ring->sampled++;
+	} else {
+		off = ring->head % ring->size;
+		n = MIN(l.len, ring->size - off);
+		memcpy(ring->data + off, l.data, n);
+		memcpy(ring->data, l.data + n, l.len - n);
+		ring->head += l.len;
+	}
+	unlock();
+}
+
+static int
+writeall(int fd, const char *s, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		if ((r = write(fd, s, len)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 1;
+		}
+		s += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+static void
+drain(void)
+{
+	uint64_t head, tail;
+	size_t off, n;
+	int err = 0;
+
+	if (lock()) {
+		return;
+	}
+	head = ring->head;
+	tail = ring->tail;
+	unlock();
+
+	/* the producers only append, so data[tail..head) stays put */
+	for (; tail < head; tail += n) {
+		off = tail % ring->size;
+		n = MIN(head - tail, ring->size - off);
+		if (!err && writeall(logfd, ring->data + off, n)) {
+			/* the lines are lost, but the ring must not clog */
+			warn("write:");
+			err = 1;
+		}
+	}
+
+	if (lock()) {
+		return;
+	}
+	ring->tail = tail;
+	unlock();
+}
+
+static void
+writer_stop(int sig)
+{
+	(void)sig;
+
+	stop = 1;
+}
+
+/*
+ * drain the ring into the log file it was spawned with, until the
+ * server goes down or a writer with a reopened one takes over
+ */
+void
+logger_write(void)
+{
+	struct sigaction sa = {
+		.sa_handler = writer_stop,
+	};
+	struct timespec interval = {
+		.tv_sec  = LOG_INTERVAL / 1000,
+		.tv_nsec = LOG_INTERVAL % 1000 * 1000000,
+	};
+	uint64_t sampled = 0, dropped = 0;
+	time_t reported = 0, now;
+	pid_t parent = getppid();
+
+	/* finish what is in the ring when the server goes down */
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGQUIT, &sa, NULL);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* only tell about the lines lost since the writer before */
+	if (!lock()) {
+		sampled = ring->sampled;
+		dropped = ring->dropped;
+		unlock();
+	}
+	for (;; nanosleep(&interval, NULL)) {
+		drain();
+		if (stop || getppid() != parent) {
+			break;
+		}
+		now = time(NULL);
+
+		/* tell about lost lines at most once a second */
+		if (now != reported && !lock()) {
+			if (ring->sampled != sampled ||
+			    ring->dropped != dropped) {
+				warn("log busy: %ju lines left out, "
+				     "%ju dropped",
+				     (uintmax_t)(ring->sampled - sampled),
+				     (uintmax_t)(ring->dropped - dropped));
+				sampled = ring->sampled;
+				dropped = ring->dropped;
+			}
+			unlock();
+			reported = now;
+		}
+	}
+}
+
+/*
+ * reopen the log file if path names another file than the one open,
+ * as after it was rotated; it returns 0 if it did, 1 if there was no
+ * need and -1 if it failed. The writers spawned afterwards get the new
+ * file, the one before is to be stopped.
+ */
+int
+logger_reopen(const char *path)
+{
+	struct stat st, cur;
+	int fd;
+
+	if (!stat(path, &st) && !fstat(logfd, &cur) &&
+	    st.st_dev == cur.st_dev && st.st_ino == cur.st_ino) {
+		return 1;
+	}
+
+	/* whoever can replace the file must not pick what root opens */
+	if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW |
+	               O_CLOEXEC, 0644)) < 0) {
+		warn("open '%s':", path);
+		return -1;
+	}
+	close(logfd);
+	logfd = fd;
+
+	return 0;
+}
+
+/*
+ * open the log file, if any, once for all writers to come and set up
+ * the ring; it returns whether there is one, to be drained by a writer
+ */
+int
+logger_open(const char *path)
+{
+	pthread_mutexattr_t attr;
+	void *p;
+
+	if (path && (logfd = open(path, O_WRONLY | O_APPEND | O_CREAT |
+	                          O_CLOEXEC, 0644)) < 0) {
+		die("open '%s':", path);
+	}
+
+	if (LOG_RING == 0) {
+		return 0;
+	}
+	if ((p = mmap(NULL, sizeof(*ring) + LOG_RING, PROT_READ |
+	              PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) ==
+	    MAP_FAILED) {
+		warn("mmap:");
+		return 0;
+	}
+
+	/* the lock is shared and survives processes dying with it */
+	if (pthread_mutexattr_init(&attr) ||
+	    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) ||
+	    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) ||
+	    pthread_mutex_init(&((struct ring *)p)->lock, &attr)) {
+		warn("pthread_mutex_init: Failed to set up the log lock");
+		munmap(p, sizeof(*ring) + LOG_RING);
+		return 0;
+	}
+	pthread_mutexattr_destroy(&attr);
+	ring = p;
+	ring->size = LOG_RING;
+
+	return 1;
+}
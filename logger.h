@@ -0,0 +1,25 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <sys/types.h>
+
+#include "connection.h"
+
+/*
+ * Every process serving requests formats its access log lines itself
+ * and hands them to a ring in shared memory, which a writer process
+ * drains to stdout or the log file in large writes. When the ring is
+ * more than half full only some of the lines are kept, when it is full
+ * they are dropped; the writer reports both. Only the supervisor opens
+ * the log file, before and after its rotation, and the writer inherits
+ * it from there.
+ */
+
+int logger_format(const char *);
+int logger_open(const char *);
+int logger_reopen(const char *);
+void logger_write(void);
+void logger_log(const struct connection *);
+
+#endif /* LOGGER_H */
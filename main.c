@@ -3,9 +3,11 @@
 #include <grp.h>
 #include <limits.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pwd.h>
 #include <regex.h>
 #include <signal.h>
+#include <stdint.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -16,65 +18,143 @@
 #include <time.h>
 #include <unistd.h>
 
-#include "data.h"
+#include "cache.h"
+#include "config.h"
+#include "connection.h"
 #include "http.h"
+#include "logger.h"
+#include "map.h"
+#include "mime.h"
+#include "queue.h"
 #include "sock.h"
+#include "stats.h"
 #include "util.h"
+#include "vhost.h"
 
 static char *udsname;
 
+/* the listening sockets, one per worker, -1 while it is not running */
+static int *insock;
+static size_t ninsock;
+
+struct worker {
+	pid_t pid;       /* 0 while it is not running */
+	time_t start;
+	time_t respawn;  /* when to start it again, 0 for never */
+	unsigned int fails;
+};
+
+/* the log writer, respawned like a worker */
+static struct worker writer;
+static volatile sig_atomic_t rotated; /* the log file may have been */
+
 static void
-logmsg(const struct connection *c)
+serve(struct connection *c, const struct server *srv)
 {
-	char inaddr_str[INET6_ADDRSTRLEN /* > INET_ADDRSTRLEN */];
-	char tstmp[21];
-
-	/* create timestamp */
-	if (!strftime(tstmp, sizeof(tstmp), "%Y-%m-%dT%H:%M:%SZ",
-	              gmtime(&(time_t){time(NULL)}))) {
-		warn("strftime: Exceeded buffer capacity");
-		/* continue anyway (we accept the truncation) */
+	struct pollfd pfd = { .fd = c->fd };
+	time_t timeout;
+
+	/* counted before anything can reset the connection */
+	stats_connection(1);
+	if (sock_set_nonblocking(c->fd)) {
+		connection_reset(c);
+		return;
 	}
 
-	/* generate address-string */
-	if (sock_get_inaddr_str(&c->ia, inaddr_str, LEN(inaddr_str))) {
-		warn("sock_get_inaddr_str: Couldn't generate adress-string");
-		inaddr_str[0] = '\0';
+	/* drive the connection, waiting for the socket in between */
+	for (connection_serve(c, srv); c->state != C_VACANT;
+	     connection_serve(c, srv)) {
+		pfd.events = (c->state == C_RECV_HEADER) ? POLLIN : POLLOUT;
+		timeout = connection_deadline(c) - time(NULL);
+		if (poll(&pfd, 1, MAX(timeout, 0) * 1000) <= 0) {
+			connection_timeout(c);
+			break;
+		}
 	}
-
-	printf("%s\t%s\t%d\t%s\t%s\n", tstmp, inaddr_str, c->res.status,
-	       c->req.field[REQ_HOST], c->req.uri);
 }
 
 static void
-serve(struct connection *c, const struct server *srv)
+serve_events(int insock, const struct server *srv, size_t nslots)
 {
-	enum status s;
-
-	/* set connection timeout */
-	if (sock_set_timeout(c->fd, 30)) {
-		goto cleanup;
+	queue_event *event;
+	struct connection *connection, *c;
+	ssize_t nready;
+	size_t i, batch, *accepted;
+	time_t now, lastsweep = 0;
+	int qfd;
+
+	/*
+	 * allocate connection slots, the event array and the batch in
+	 * which each slot last took a connection
+	 */
+	connection = calloc(nslots, sizeof(*connection));
+	event = reallocarray(NULL, nslots + 1, sizeof(*event));
+	accepted = calloc(nslots, sizeof(*accepted));
+	if (!connection || !event || !accepted) {
+		die("calloc:");
 	}
 
-	/* handle request */
-	if ((s = http_recv_header(c->fd, c->header, LEN(c->header), &c->off)) ||
-	    (s = http_parse_header(c->header, &c->req))) {
-		http_prepare_error_response(&c->req, &c->res, s);
-	} else {
-		http_prepare_response(&c->req, &c->res, srv);
+	/* watch the listening socket */
+	if ((qfd = queue_create()) < 0 || sock_set_nonblocking(insock) ||
+	    queue_add_fd(qfd, insock, QUEUE_EVENT_IN, 1, NULL)) {
+		exit(1);
 	}
 
-	if ((s = http_send_header(c->fd, &c->res)) ||
-	    (s = http_send_body(c->fd, &c->res, &c->req))) {
-		c->res.status = s;
-	}
+	for (batch = 1; ; batch++) {
+		if ((nready = queue_wait(qfd, event, nslots + 1, 1000)) < 0) {
+			continue;
+		}
+
+		for (i = 0; i < (size_t)nready; i++) {
+			if (!(c = queue_event_get_data(&event[i]))) {
+				/* accept all pending connections */
+				while ((c = connection_accept(insock, connection,
+				                              nslots))) {
+					accepted[c - connection] = batch;
+					if (queue_add_fd(qfd, c->fd,
+					                 QUEUE_EVENT_IN, 0, c)) {
+						connection_reset(c);
+					}
+				}
+				continue;
+			}
 
-	logmsg(c);
-cleanup:
-	/* clean up and finish */
-	shutdown(c->fd, SHUT_RD);
-	shutdown(c->fd, SHUT_WR);
-	close(c->fd);
+			/*
+			 * the events were gathered for the connections as
+			 * they were, those since closed, perhaps making room
+			 * for another, are gone
+			 */
+			if (c->state == C_VACANT || accepted[c - connection] ==
+			    batch) {
+				continue;
+			}
+
+			if (queue_event_is_error(&event[i])) {
+				connection_drop(c, S_REQUEST_TIMEOUT);
+				continue;
+			}
+
+			connection_serve(c, srv);
+
+			/* wait for the event the connection needs next */
+			if (c->state != C_VACANT &&
+			    queue_mod_fd(qfd, c->fd, (c->state == C_RECV_HEADER) ?
+			                 QUEUE_EVENT_IN : QUEUE_EVENT_OUT, c)) {
+				connection_reset(c);
+			}
+		}
+
+		/* drop connections that have been idle for too long */
+		if ((now = time(NULL)) != lastsweep) {
+			for (i = 0; i < nslots; i++) {
+				if (connection[i].state != C_VACANT &&
+				    now >= connection_deadline(&connection[i])) {
+					connection_timeout(&connection[i]);
+				}
+			}
+			lastsweep = now;
+		}
+	}
 }
 
 static void
@@ -92,6 +172,21 @@ sigcleanup(int sig)
 	_exit(1);
 }
 
+static void
+sigalarm(int sig)
+{
+	/* only interrupt wait() */
+	(void)sig;
+}
+
+static void
+sighup(int sig)
+{
+	/* check whether the log file was rotated right away */
+	(void)sig;
+	rotated = 1;
+}
+
 static void
 handlesignals(void(*hdl)(int))
 {
@@ -106,6 +201,181 @@ handlesignals(void(*hdl)(int))
 	sigaction(SIGQUIT, &sa, NULL);
 }
 
+static void
+serve_forks(int insock, const struct server *srv)
+{
+	/* reap children automatically */
+	if (signal(SIGCHLD, SIG_IGN) == SIG_ERR) {
+		die("signal: Failed to set SIG_IGN on SIGCHLD");
+	}
+
+	/* accept incoming connections */
+	while (1) {
+		struct connection c = { 0 };
+
+		if ((c.fd = accept(insock, (struct sockaddr *)&c.ia,
+		                   &(socklen_t){sizeof(c.ia)})) < 0) {
+			warn("accept:");
+			continue;
+		}
+
+		/* fork and handle */
+		switch (fork()) {
+		case 0:
+			serve(&c, srv);
+			exit(0);
+			break;
+		case -1:
+			warn("fork:");
+			/* fallthrough */
+		default:
+			/* close the connection in the parent */
+			close(c.fd);
+		}
+	}
+}
+
+/* chroot into dir and drop root, as all children do */
+static void
+dropprivs(const char *dir, const struct passwd *pwd, const struct group *grp)
+{
+	/* chroot */
+	if (chdir(dir) < 0) {
+		die("chdir '%s':", dir);
+	}
+	if (chroot(".") < 0) {
+		die("chroot .:");
+	}
+
+	/* drop root */
+	if (setgroups(1, &(grp->gr_gid)) < 0) {
+		die("setgroups:");
+	}
+	if (setgid(grp->gr_gid) < 0) {
+		die("setgid:");
+	}
+	if (setuid(pwd->pw_uid) < 0) {
+		die("setuid:");
+	}
+
+	if (getuid() == 0) {
+		die("Won't run as root user", argv0);
+	}
+	if (getgid() == 0) {
+		die("Won't run as root group", argv0);
+	}
+}
+
+/* close the listening sockets but keep, a shared one only once */
+static void
+closesocks(int keep)
+{
+	size_t i;
+
+	for (i = 0; i < ninsock; i++) {
+		if (insock[i] >= 0 && insock[i] != keep &&
+		    (i == 0 || insock[i] != insock[i - 1])) {
+			close(insock[i]);
+		}
+	}
+}
+
+static pid_t
+spawn_worker(size_t i, const struct server *srv, size_t nslots,
+             const char *servedir, const struct passwd *pwd,
+             const struct group *grp)
+{
+	pid_t pid;
+
+	switch ((pid = fork())) {
+	case -1:
+		warn("fork:");
+		break;
+	case 0:
+		/* restore default handlers */
+		handlesignals(SIG_DFL);
+
+		/* the kernel would queue connections on the others for us */
+		closesocks(insock[i]);
+
+		/* limit ourselves to reading the servedir and block further unveils */
+		eunveil(servedir, "r");
+		eunveil(NULL, NULL);
+
+		dropprivs(servedir, pwd, grp);
+
+		if (udsname) {
+			epledge("stdio rpath proc unix", NULL);
+		} else {
+			epledge("stdio rpath proc inet", NULL);
+		}
+
+		if (nslots) {
+			/* serve all connections from within this worker */
+			if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+				die("signal: Failed to set SIG_IGN on SIGPIPE");
+			}
+			serve_events(insock[i], srv, nslots);
+		} else {
+			serve_forks(insock[i], srv);
+		}
+		exit(0);
+	}
+
+	return pid;
+}
+
+/*
+ * the log writer only writes to the log file it inherits, it is given
+ * nothing more than a worker
+ */
+static pid_t
+spawn_writer(const char *servedir, const struct passwd *pwd,
+             const struct group *grp)
+{
+	pid_t pid;
+
+	switch ((pid = fork())) {
+	case -1:
+		warn("fork:");
+		break;
+	case 0:
+		/* restore default handlers */
+		handlesignals(SIG_DFL);
+		closesocks(-1);
+
+		eunveil(servedir, "r");
+		eunveil(NULL, NULL);
+		dropprivs(servedir, pwd, grp);
+		epledge("stdio", NULL);
+
+		logger_write();
+		exit(0);
+	}
+
+	return pid;
+}
+
+/*
+ * a worker dying right after its start likely hit a persistent error,
+ * it is respawned after a delay that doubles each time it does so in
+ * a row, and given up on after RESPAWN_RETRIES
+ */
+static void
+worker_gone(struct worker *w, time_t now)
+{
+	w->fails = (now - w->start < 1) ? w->fails + 1 : 0;
+	w->pid = 0;
+	if (w->fails > RESPAWN_RETRIES) {
+		w->respawn = 0;
+	} else if (w->fails) {
+		w->respawn = now + MIN((time_t)1 << (w->fails - 1),
+		                       RESPAWN_MAXDELAY);
+	} else {
+		w->respawn = now;
+	}
+}
+
 static int
 spacetok(const char *s, char **t, size_t tlen)
 {
@@ -177,11 +447,63 @@ err:
 	return 1;
 }
 
+static int
+addvhost(struct server *srv, const char *s)
+{
+	char *tok[4];
+
+	if (spacetok(s, tok, 4) || !tok[0] || !tok[1] || !tok[2]) {
+		return 1;
+	}
+	if (!(srv->vhost = reallocarray(srv->vhost, ++srv->vhost_len,
+	                                sizeof(*srv->vhost)))) {
+		die("reallocarray:");
+	}
+	srv->vhost[srv->vhost_len - 1].chost  = tok[0];
+	srv->vhost[srv->vhost_len - 1].regex  = tok[1];
+	srv->vhost[srv->vhost_len - 1].dir    = tok[2];
+	srv->vhost[srv->vhost_len - 1].prefix = tok[3];
+
+	return 0;
+}
+
+/* a vhost per line as given to -v, skipping empty lines and comments */
+static void
+addvhosts(struct server *srv, const char *path)
+{
+	FILE *fp;
+	size_t len = 0, lineno;
+	ssize_t n;
+	char *line = NULL;
+
+	if (!(fp = fopen(path, "r"))) {
+		die("fopen '%s':", path);
+	}
+	for (lineno = 1; (n = getline(&line, &len, fp)) >= 0; lineno++) {
+		for (; n > 0 && strchr("\r\n", line[n - 1]); n--)
+			;
+		line[n] = '\0';
+		if (n == 0 || line[0] == '#') {
+			continue;
+		}
+		if (addvhost(srv, line)) {
+			die("%s:%zu: invalid vhost", path, lineno);
+		}
+	}
+	if (ferror(fp)) {
+		die("getline '%s':", path);
+	}
+	free(line);
+	fclose(fp);
+}
+
 static void
 usage(void)
 {
-	const char *opts = "[-u user] [-g group] [-n num] [-d dir] [-l] "
-	                   "[-i file] [-v vhost] ... [-m map] ...";
+	const char *opts = "[-u user] [-g group] [-n num] [-s num] [-w num] "
+	                   "[-d dir] [-l] [-i file] [-v vhost] ... "
+	                   "[-V file] ... [-m map] ... [-o file] [-f format] "
+	                   "[-M metrics]";
 
 	die("usage: %s -p port [-h host] %s\n"
 	    "       %s -U file [-p port] %s", argv0,
@@ -197,14 +519,21 @@ main(int argc, char *argv[])
 	struct server srv = {
 		.docindex = "index.html",
 	};
-	size_t i;
-	int insock, status = 0;
-	const char *err;
-	char *tok[4];
+	struct sigaction sa = { 0 };
+	struct worker *worker;
+	size_t i, live, nslots = 0, nworkers = 0;
+	pid_t pid;
+	time_t now, next, logcheck = 0;
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	int status = 0, logring;
+	const char *err, *p;
+	char *tok[4], logdir[PATH_MAX];
 
 	/* defaults */
 	int maxnprocs = 512;
 	char *servedir = ".";
+	char *logfile = NULL;
 	char *user = "nobody";
 	char *group = "nogroup";
 
@@ -212,6 +541,11 @@ main(int argc, char *argv[])
 	case 'd':
 		servedir = EARGF(usage());
 		break;
+	case 'f':
+		if (logger_format(EARGF(usage()))) {
+			usage();
+		}
+		break;
 	case 'g':
 		group = EARGF(usage());
 		break;
@@ -227,6 +561,16 @@ main(int argc, char *argv[])
 	case 'l':
 		srv.listdirs = 1;
 		break;
+	case 'M':
+		if (spacetok(EARGF(usage()), tok, 2) || !tok[0]) {
+			usage();
+		}
+		srv.metrics = tok[0];
+		srv.metricshost = tok[1];
+		if (srv.metrics[0] != '/') {
+			die("The metrics URI must begin with '/'");
+		}
+		break;
 	case 'm':
 		if (spacetok(EARGF(usage()), tok, 3) || !tok[0] || !tok[1]) {
 			usage();
@@ -239,6 +583,9 @@ main(int argc, char *argv[])
 		srv.map[srv.map_len - 1].to    = tok[1];
 		srv.map[srv.map_len - 1].chost = tok[2];
 		break;
+	case 'o':
+		logfile = EARGF(usage());
+		break;
 	case 'n':
 		maxnprocs = strtonum(EARGF(usage()), 1, INT_MAX, &err);
 		if (err) {
@@ -248,25 +595,31 @@ main(int argc, char *argv[])
 	case 'p':
 		srv.port = EARGF(usage());
 		break;
+	case 's':
+		nslots = strtonum(EARGF(usage()), 1, INT_MAX, &err);
+		if (err) {
+			die("strtonum '%s': %s", EARGF(usage()), err);
+		}
+		break;
 	case 'U':
 		udsname = EARGF(usage());
 		break;
 	case 'u':
 		user = EARGF(usage());
 		break;
+	case 'w':
+		nworkers = strtonum(EARGF(usage()), 1, INT_MAX, &err);
+		if (err) {
+			die("strtonum '%s': %s", EARGF(usage()), err);
+		}
+		break;
 	case 'v':
-		if (spacetok(EARGF(usage()), tok, 4) || !tok[0] || !tok[1] ||
-		    !tok[2]) {
+		if (addvhost(&srv, EARGF(usage()))) {
 			usage();
 		}
-		if (!(srv.vhost = reallocarray(srv.vhost, ++srv.vhost_len,
-		                               sizeof(*srv.vhost)))) {
-			die("reallocarray:");
-		}
-		srv.vhost[srv.vhost_len - 1].chost  = tok[0];
-		srv.vhost[srv.vhost_len - 1].regex  = tok[1];
-		srv.vhost[srv.vhost_len - 1].dir    = tok[2];
-		srv.vhost[srv.vhost_len - 1].prefix = tok[3];
+		break;
+	case 'V':
+		addvhosts(&srv, EARGF(usage()));
 		break;
 	default:
 		usage();
@@ -286,6 +639,21 @@ main(int argc, char *argv[])
 		    strerror(errno) : "File exists");
 	}
 
+	/*
+	 * a worker pool serves from event loops, otherwise a single
+	 * worker forks for each connection
+	 */
+	if (nslots || nworkers) {
+		if (!nworkers) {
+			nworkers = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+		}
+		if (!nslots) {
+			nslots = 512;
+		}
+	} else {
+		nworkers = 1;
+	}
+
 	/* compile and check the supplied vhost regexes */
 	for (i = 0; i < srv.vhost_len; i++) {
 		if (regcomp(&srv.vhost[i].re, srv.vhost[i].regex,
@@ -294,6 +662,23 @@ main(int argc, char *argv[])
 			    srv.vhost[i].regex);
 		}
 	}
+	if (srv.vhost) {
+		vhost_init(&srv);
+	}
+
+	/* with vhosts, the metrics are only served on the one named */
+	if (srv.metrics && (srv.vhost || srv.metricshost)) {
+		for (i = 0; i < srv.vhost_len && (!srv.metricshost ||
+		     strcmp(srv.vhost[i].chost, srv.metricshost)); i++)
+			;
+		if (i == srv.vhost_len) {
+			die("The metrics host must be the canonical host "
+			    "of a vhost");
+		}
+	}
+	if (srv.map) {
+		map_init(&srv);
+	}
 
 	/* raise the process limit */
 	rlim.rlim_cur = rlim.rlim_max = maxnprocs;
@@ -301,6 +686,19 @@ main(int argc, char *argv[])
 		die("setrlimit RLIMIT_NPROC:");
 	}
 
+	/*
+	 * make room for a socket, a file and a pipe per slot next to the
+	 * files the worker keeps open, as far as the hard limit allows
+	 */
+	if (getrlimit(RLIMIT_NOFILE, &rlim) < 0) {
+		die("getrlimit RLIMIT_NOFILE:");
+	}
+	rlim.rlim_cur = MIN(rlim.rlim_max, MAX(rlim.rlim_cur,
+	                    (rlim_t)nslots * 4 + FDCACHE_ENTRIES + 16));
+	if (setrlimit(RLIMIT_NOFILE, &rlim) < 0) {
+		die("setrlimit RLIMIT_NOFILE:");
+	}
+
 	/* validate user and group */
 	errno = 0;
 	if (!user || !(pwd = getpwnam(user))) {
@@ -313,105 +711,231 @@ main(int argc, char *argv[])
 		    errno ? strerror(errno) : "Entry not found");
 	}
 
+	/* the workers share rendered listings, compressed and small files */
+	srv.cache = cache_create(CACHE_SIZE, CACHE_ENTRIES);
+	srv.filecache = cache_create(FILECACHE_SIZE, FILECACHE_ENTRIES);
+
+	/* the workers count into slots of their own */
+	if (srv.metrics && stats_create(nworkers)) {
+		die("Failed to set up the metrics");
+	}
+
+	/* the mime types are read before the workers chroot */
+	mime_init(MIMETYPES);
+
 	/* open a new process group */
 	setpgid(0, 0);
 
 	handlesignals(sigcleanup);
 
-	/* bind socket */
-	insock = udsname ? sock_get_uds(udsname, pwd->pw_uid, grp->gr_gid) :
-	                   sock_get_ips(srv.host, srv.port);
+	/* the log writer drains what all others log */
+	if ((logring = logger_open(logfile))) {
+		writer.start = time(NULL);
+		if ((writer.pid = spawn_writer(servedir, pwd, grp)) < 0) {
+			worker_gone(&writer, writer.start);
+		}
+	}
 
-	switch (fork()) {
-	case -1:
-		warn("fork:");
-		break;
-	case 0:
-		/* restore default handlers */
-		handlesignals(SIG_DFL);
+	/* the supervisor reopens the log file after its rotation */
+	if (logring && logfile) {
+		if ((p = strrchr(logfile, '/'))) {
+			/* the root directory if it is the only slash */
+			if (esnprintf(logdir, sizeof(logdir), "%.*s", (int)
+			              MAX(p - logfile, 1), logfile)) {
+				die("Log file directory too long");
+			}
+		} else {
+			logdir[0] = '.';
+			logdir[1] = '\0';
+		}
+		logcheck = time(NULL) + LOG_REOPEN;
+		sa.sa_handler = sighup;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGHUP, &sa, NULL);
+	}
 
-		/* reap children automatically */
-		if (signal(SIGCHLD, SIG_IGN) == SIG_ERR) {
-			die("signal: Failed to set SIG_IGN on SIGCHLD");
+	/*
+	 * bind sockets: each worker gets its own SO_REUSEPORT-socket so
+	 * the kernel spreads the connections evenly among them, while
+	 * a UNIX-domain socket can only be shared
+	 */
+	if (!(insock = reallocarray(NULL, nworkers, sizeof(*insock))) ||
+	    !(worker = calloc(nworkers, sizeof(*worker)))) {
+		die("calloc:");
+	}
+	for (i = 0; i < nworkers; i++) {
+		if (udsname) {
+			insock[i] = i ? insock[0] : sock_get_uds(udsname,
+			            pwd->pw_uid, grp->gr_gid);
+		} else {
+			insock[i] = sock_get_ips(srv.host, srv.port,
+			                         nworkers > 1);
 		}
+	}
+	ninsock = nworkers;
 
-		/* limit ourselves to reading the servedir and block further unveils */
-		eunveil(servedir, "r");
-		eunveil(NULL, NULL);
+	/* the address to bind the socket of a respawned worker to again */
+	if (!udsname && getsockname(insock[0], (struct sockaddr *)&addr,
+	                            &addrlen) < 0) {
+		die("getsockname:");
+	}
 
-		/* chroot */
-		if (chdir(servedir) < 0) {
-			die("chdir '%s':", servedir);
-		}
-		if (chroot(".") < 0) {
-			die("chroot .:");
+	for (i = 0; i < nworkers; i++) {
+		/* the worker inherits the slot it counts into */
+		stats_worker(i);
+		worker[i].start = time(NULL);
+		if ((worker[i].pid = spawn_worker(i, &srv, nslots, servedir,
+		                                  pwd, grp)) < 0) {
+			worker_gone(&worker[i], worker[i].start);
 		}
+	}
 
-		/* drop root */
-		if (setgroups(1, &(grp->gr_gid)) < 0) {
-			die("setgroups:");
+	/* limit ourselves even further while we are supervising */
+	if (logring && logfile) {
+		eunveil(logdir, "rwc");
+	}
+	if (udsname) {
+		eunveil(udsname, "c");
+		eunveil(NULL, NULL);
+		epledge((logring && logfile) ? "stdio rpath wpath cpath proc" :
+		        "stdio proc cpath", NULL);
+	} else {
+		eunveil("/", "");
+		eunveil(NULL, NULL);
+		epledge((logring && logfile) ?
+		        "stdio rpath wpath cpath proc inet" : "stdio proc inet",
+		        NULL);
+	}
+
+	/* the alarm for the next delayed respawn interrupts wait() */
+	sa.sa_handler = sigalarm;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGALRM, &sa, NULL);
+
+	/* respawn workers that die */
+	for (;;) {
+		now = time(NULL);
+		next = 0;
+		live = 0;
+		for (i = 0; i < nworkers; i++) {
+			if (!worker[i].pid && worker[i].respawn &&
+			    worker[i].respawn <= now) {
+				stats_worker(i);
+				worker[i].start = now;
+				if (insock[i] < 0) {
+					insock[i] = sock_get_addr(&addr,
+					            addrlen, nworkers > 1);
+				}
+				if (insock[i] < 0 ||
+				    (worker[i].pid = spawn_worker(i, &srv,
+				     nslots, servedir, pwd, grp)) < 0) {
+					worker_gone(&worker[i], now);
+				}
+			}
+			/*
+			 * the kernel keeps spreading connections over the
+			 * socket of a worker waiting for its respawn or given
+			 * up on, and nobody would accept them
+			 */
+			if (!worker[i].pid && !udsname && insock[i] >= 0) {
+				close(insock[i]);
+				insock[i] = -1;
+			}
+			if (worker[i].pid) {
+				live++;
+			} else if (worker[i].respawn) {
+				live++;
+				if (!next || worker[i].respawn < next) {
+					next = worker[i].respawn;
+				}
+			}
 		}
-		if (setgid(grp->gr_gid) < 0) {
-			die("setgid:");
+		if (!live) {
+			warn("all workers were given up on");
+			break;
 		}
-		if (setuid(pwd->pw_uid) < 0) {
-			die("setuid:");
+		/*
+		 * a new writer takes over the reopened log file, while the
+		 * one before finishes draining into the old one; a failure
+		 * is retried every second
+		 */
+		if (logring && logfile && (rotated || logcheck <= now)) {
+			rotated = 0;
+			logcheck = now + LOG_REOPEN;
+			switch (logger_reopen(logfile)) {
+			case 0:
+				if (writer.pid > 0) {
+					kill(writer.pid, SIGTERM);
+				}
+				writer.pid = 0;
+				writer.fails = 0;
+				writer.respawn = now;
+				break;
+			case -1:
+				logcheck = now + 1;
+				break;
+			}
 		}
-
-		if (udsname) {
-			epledge("stdio rpath proc unix", NULL);
-		} else {
-			epledge("stdio rpath proc inet", NULL);
+		if (logring && logfile && (!next || logcheck < next)) {
+			next = logcheck;
 		}
-
-		if (getuid() == 0) {
-			die("Won't run as root user", argv0);
+		if (!writer.pid && writer.respawn && writer.respawn <= now) {
+			writer.start = now;
+			if ((writer.pid = spawn_writer(servedir, pwd,
+			                               grp)) < 0) {
+				worker_gone(&writer, now);
+			}
 		}
-		if (getgid() == 0) {
-			die("Won't run as root group", argv0);
+		if (!writer.pid && writer.respawn &&
+		    (!next || writer.respawn < next)) {
+			next = writer.respawn;
 		}
 
-		/* accept incoming connections */
-		while (1) {
-			struct connection c = { 0 };
-
-			if ((c.fd = accept(insock, (struct sockaddr *)&c.ia,
-			                   &(socklen_t){sizeof(c.ia)})) < 0) {
-				warn("accept:");
+		alarm(next ? MAX(next - now, 1) : 0);
+		if ((pid = wait(&status)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == ECHILD && next) {
+				/* nothing to wait for but the alarm */
+				pause();
 				continue;
 			}
+			break;
+		}
 
-			/* fork and handle */
-			switch (fork()) {
-			case 0:
-				serve(&c, &srv);
-				exit(0);
-				break;
-			case -1:
-				warn("fork:");
-				/* fallthrough */
-			default:
-				/* close the connection in the parent */
-				close(c.fd);
+		if (writer.pid && pid == writer.pid) {
+			worker_gone(&writer, time(NULL));
+			if (!writer.respawn) {
+				warn("log writer %d keeps dying right after "
+				     "its start, giving up on it", pid);
+			} else {
+				warn("log writer %d died, respawning", pid);
 			}
+			continue;
 		}
-		exit(0);
-	default:
-		/* limit ourselves even further while we are waiting */
-		if (udsname) {
-			eunveil(udsname, "c");
-			eunveil(NULL, NULL);
-			epledge("stdio cpath", NULL);
+		for (i = 0; i < nworkers && worker[i].pid != pid; i++)
+			;
+		if (i == nworkers) {
+			continue;
+		}
+		worker_gone(&worker[i], time(NULL));
+		if (!worker[i].respawn) {
+			warn("worker %d keeps dying right after its start, "
+			     "giving up on it", pid);
+		} else if (worker[i].fails) {
+			warn("worker %d died right after its start, "
+			     "respawning in %jd s", pid,
+			     (intmax_t)(worker[i].respawn - time(NULL)));
 		} else {
-			eunveil("/", "");
-			eunveil(NULL, NULL);
-			epledge("stdio", NULL);
+			warn("worker %d died, respawning", pid);
 		}
+	}
 
-		while (wait(&status) > 0)
-			;
+	/* take the remaining workers down with us */
+	if (signal(SIGTERM, SIG_IGN) != SIG_ERR) {
+		kill(0, SIGTERM);
 	}
 
 	cleanup();
-	return status;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
 }
@@ -0,0 +1,131 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdlib.h>
+#include <string.h>
+
+#include "map.h"
+#include "util.h"
+
+/*
+ * Node 0 is the root, every other node is reached by one edge from
+ * its parent. The edges of all nodes share a hash table keyed by the
+ * parent and the component, kept at most half full.
+ */
+static struct edge {
+	size_t parent;
+	const char *name;   /* NULL if the slot is unused */
+	size_t len;
+	size_t child;
+} *edge;
+static size_t nedges;
+
+/* the first map ending at each node + 1, and the next with its prefix */
+static size_t *first, *next;
+
+static size_t
+hash(size_t parent, const char *s, size_t len)
+{
+	size_t h = 5381 + parent;
+
+	while (len--) {
+		h = h * 33 + (unsigned char)*s++;
+	}
+
+	return h;
+}
+
+static size_t
+find(size_t parent, const char *name, size_t len)
+{
+	size_t i;
+
+	for (i = hash(parent, name, len) & (nedges - 1);
+	     edge[i].name && (edge[i].parent != parent ||
+	     edge[i].len != len || memcmp(edge[i].name, name, len));
+	     i = (i + 1) & (nedges - 1))
+		;
+
+	return i;
+}
+
+/* the next component of s, skipping slashes, with its length in len */
+static const char *
+component(const char *s, size_t *len)
+{
+	for (; *s == '/'; s++)
+		;
+	*len = strcspn(s, "/");
+
+	return *len ? s : NULL;
+}
+
+void
+map_init(const struct server *srv)
+{
+	const char *p;
+	size_t i, j, n, len, node, nnodes, *m;
+
+	/* each component adds at most one node */
+	for (i = 0, n = 1; i < srv->map_len; i++) {
+		for (p = srv->map[i].from; (p = component(p, &len)); p += len) {
+			n++;
+		}
+	}
+	for (nedges = 16; nedges < 2 * n; nedges *= 2)
+		;
+	if (!(edge = calloc(nedges, sizeof(*edge))) ||
+	    !(first = calloc(n, sizeof(*first))) ||
+	    !(next = calloc(srv->map_len, sizeof(*next)))) {
+		die("calloc:");
+	}
+
+	nnodes = 1;
+	for (i = 0; i < srv->map_len; i++) {
+		node = 0;
+		for (p = srv->map[i].from; (p = component(p, &len)); p += len) {
+			if (!edge[j = find(node, p, len)].name) {
+				edge[j].parent = node;
+				edge[j].name = p;
+				edge[j].len = len;
+				edge[j].child = nnodes++;
+			}
+			node = edge[j].child;
+		}
+
+		/* append, so the map given first stays first */
+		for (m = &first[node]; *m; m = &next[*m - 1])
+			;
+		*m = i + 1;
+	}
+}
+
+const struct map *
+map_match(const struct server *srv, const char *uri, const char *chost)
+{
+	const struct map *best = NULL, *map;
+	const char *p = uri;
+	size_t i, j, len, node = 0;
+
+	for (;;) {
+		/*
+		 * the prefix must match as given, as "/a/" does not
+		 * apply to "/a", and be meant for the canonical host
+		 */
+		for (i = first[node]; i; i = next[i - 1]) {
+			map = &srv->map[i - 1];
+			if (!strncmp(uri, map->from, strlen(map->from)) &&
+			    !(chost && map->chost && strcmp(map->chost, chost))) {
+				best = map;
+				break;
+			}
+		}
+
+		if (!(p = component(p, &len)) ||
+		    !edge[j = find(node, p, len)].name) {
+			break;
+		}
+		node = edge[j].child;
+		p += len;
+	}
+
+	return best;
+}
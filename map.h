@@ -0,0 +1,18 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef MAP_H
+#define MAP_H
+
+#include "util.h"
+
+/*
+ * The URI prefix maps are arranged in a trie of path components before
+ * the workers are forked. A URI is rewritten by the map with the
+ * longest prefix of it that applies to the canonical host; among maps
+ * with the same prefix the one given first wins.
+ */
+
+void map_init(const struct server *);
+const struct map *map_match(const struct server *, const char *,
+                            const char *);
+
+#endif /* MAP_H */
@@ -0,0 +1,163 @@
+/* See LICENSE file for copyright and license details. */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "mime.h"
+#include "util.h"
+
+/* longest extension looked up, e.g. "tar.gz" */
+#define EXT_MAX 32
+
+struct mime {
+	char *ext;
+	char *type;
+};
+
+/* open addressing, kept at most half full */
+static struct mime *slot;
+static size_t nslots, nused;
+
+static size_t
+hash(const char *s)
+{
+	size_t h = 5381;
+
+	while (*s) {
+		h = h * 33 + (unsigned char)*s++;
+	}
+
+	return h;
+}
+
+/* lowercase s[0..len) into ext, 1 if it doesn't fit */
+static int
+lower(char ext[EXT_MAX], const char *s, size_t len)
+{
+	size_t i;
+
+	if (len == 0 || len >= EXT_MAX) {
+		return 1;
+	}
+	for (i = 0; i < len; i++) {
+		ext[i] = tolower((unsigned char)s[i]);
+	}
+	ext[len] = '\0';
+
+	return 0;
+}
+
+static size_t
+find(const char *ext)
+{
+	size_t i;
+
+	for (i = hash(ext) & (nslots - 1);
+	     slot[i].ext && strcmp(slot[i].ext, ext);
+	     i = (i + 1) & (nslots - 1))
+		;
+
+	return i;
+}
+
+static int
+grow(void)
+{
+	struct mime *old = slot;
+	size_t i, n = nslots;
+
+	if (!(slot = calloc(nslots = n ? 2 * n : 256, sizeof(*slot)))) {
+		slot = old;
+		nslots = n;
+		return 1;
+	}
+	for (i = 0; i < n; i++) {
+		if (old[i].ext) {
+			slot[find(old[i].ext)] = old[i];
+		}
+	}
+	free(old);
+
+	return 0;
+}
+
+/* later definitions of an extension replace earlier ones */
+static void
+add(const char *s, size_t len, const char *type)
+{
+	char ext[EXT_MAX], *t;
+	size_t i;
+
+	if (lower(ext, s, len) || (2 * (nused + 1) > nslots && grow()) ||
+	    !(t = strdup(type))) {
+		return;
+	}
+	if (slot[i = find(ext)].ext) {
+		free(slot[i].type);
+		slot[i].type = t;
+	} else if ((slot[i].ext = strdup(ext))) {
+		slot[i].type = t;
+		nused++;
+	} else {
+		free(t);
+	}
+}
+
+void
+mime_init(const char *path)
+{
+	FILE *fp;
+	size_t i, len;
+	char *line = NULL, *p, *type;
+	static const char *ws = " \t\r\n";
+
+	/* "type ext ...", comments start with '#' */
+	if (path && (fp = fopen(path, "r"))) {
+		for (len = 0; getline(&line, &len, fp) >= 0; ) {
+			if ((p = strchr(line, '#'))) {
+				*p = '\0';
+			}
+			if (!(type = strtok(line, ws))) {
+				continue;
+			}
+			while ((p = strtok(NULL, ws))) {
+				add(p, strlen(p), type);
+			}
+		}
+		free(line);
+		fclose(fp);
+	}
+
+	for (i = 0; i < LEN(mimes); i++) {
+		add(mimes[i].ext, strlen(mimes[i].ext), mimes[i].type);
+	}
+}
+
+/*
+ * the type of a file name by its longest known extension, so that
+ * "x.tar.gz" can differ from "x.gz", or NULL if none is known
+ */
+const char *
+mime_type(const char *name)
+{
+	const char *p;
+	char ext[EXT_MAX];
+	size_t i;
+
+	if (!nused) {
+		return NULL;
+	}
+	if ((p = strrchr(name, '/'))) {
+		name = p + 1;
+	}
+	for (p = strchr(name, '.'); p; p = strchr(p + 1, '.')) {
+		if (!lower(ext, p + 1, strlen(p + 1)) &&
+		    slot[i = find(ext)].ext) {
+			return slot[i].type;
+		}
+	}
+
+	return NULL;
+}
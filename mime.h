@@ -0,0 +1,14 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef MIME_H
+#define MIME_H
+
+/*
+ * Extensions are mapped to media types by a hash table filled before
+ * the workers are forked: from a mime.types file, if there is one,
+ * and then from the mimes[] table in config.h, which takes precedence.
+ */
+
+void mime_init(const char *);
+const char *mime_type(const char *);
+
+#endif /* MIME_H */
@@ -0,0 +1,26 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+
+typedef struct epoll_event queue_event;
+
+enum queue_event_type {
+	QUEUE_EVENT_IN,
+	QUEUE_EVENT_OUT,
+};
+
+int queue_create(void);
+int queue_add_fd(int, int, enum queue_event_type, int, const void *);
+int queue_mod_fd(int, int, enum queue_event_type, const void *);
+int queue_rem_fd(int, int);
+ssize_t queue_wait(int, queue_event *, size_t, int);
+
+void *queue_event_get_data(const queue_event *);
+
+int queue_event_is_error(const queue_event *);
+
+#endif /* QUEUE_H */
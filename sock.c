@@ -1,5 +1,6 @@
 /* See LICENSE file for copyright and license details. */
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <stddef.h>
@@ -8,7 +9,6 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
-#include <sys/time.h>
 #include <sys/un.h>
 #include <unistd.h>
 
@@ -16,7 +16,7 @@
 #include "util.h"
 
 int
-sock_get_ips(const char *host, const char* port)
+sock_get_ips(const char *host, const char* port, int reuseport)
 {
 	struct addrinfo hints = {
 		.ai_flags    = AI_NUMERICSERV,
@@ -39,6 +39,10 @@ sock_get_ips(const char *host, const char* port)
 		               &(int){1}, sizeof(int)) < 0) {
 			die("setsockopt:");
 		}
+		if (reuseport && setsockopt(insock, SOL_SOCKET, SO_REUSEPORT,
+		                            &(int){1}, sizeof(int)) < 0) {
+			die("setsockopt:");
+		}
 		if (bind(insock, p->ai_addr, p->ai_addrlen) < 0) {
 			if (close(insock) < 0) {
 				die("close:");
@@ -59,6 +63,39 @@ sock_get_ips(const char *host, const char* port)
 	return insock;
 }
 
+/* bind another listening socket to the address of an earlier one */
+int
+sock_get_addr(const struct sockaddr_storage *addr, socklen_t addrlen,
+              int reuseport)
+{
+	int insock;
+
+	if ((insock = socket(addr->ss_family, SOCK_STREAM, 0)) < 0) {
+		warn("socket:");
+		return -1;
+	}
+	if (setsockopt(insock, SOL_SOCKET, SO_REUSEADDR, &(int){1},
+	               sizeof(int)) < 0 ||
+	    (reuseport && setsockopt(insock, SOL_SOCKET, SO_REUSEPORT,
+	                             &(int){1}, sizeof(int)) < 0)) {
+		warn("setsockopt:");
+		close(insock);
+		return -1;
+	}
+	if (bind(insock, (const struct sockaddr *)addr, addrlen) < 0) {
+		warn("bind:");
+		close(insock);
+		return -1;
+	}
+	if (listen(insock, SOMAXCONN) < 0) {
+		warn("listen:");
+		close(insock);
+		return -1;
+	}
+
+	return insock;
+}
+
 void
 sock_rem_uds(const char *udsname)
 {
@@ -109,16 +146,19 @@ sock_get_uds(const char *udsname, uid_t uid, gid_t gid)
 }
 
 int
-sock_set_timeout(int fd, int sec)
+sock_set_nonblocking(int fd)
 {
-	struct timeval tv;
+	int flags;
 
-	tv.tv_sec = sec;
-	tv.tv_usec = 0;
+	if ((flags = fcntl(fd, F_GETFL, 0)) < 0) {
+		warn("fcntl:");
+		return 1;
+	}
 
-	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
-	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
-		warn("setsockopt:");
+	flags |= O_NONBLOCK;
+
+	if (fcntl(fd, F_SETFL, flags) < 0) {
+		warn("fcntl:");
 		return 1;
 	}
 
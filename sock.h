@@ -6,10 +6,11 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
-int sock_get_ips(const char *, const char *);
+int sock_get_ips(const char *, const char *, int);
+int sock_get_addr(const struct sockaddr_storage *, socklen_t, int);
 void sock_rem_uds(const char *);
 int sock_get_uds(const char *, uid_t, gid_t);
-int sock_set_timeout(int, int);
+int sock_set_nonblocking(int);
 int sock_get_inaddr_str(const struct sockaddr_storage *, char *, size_t);
 
 #endif /* SOCK_H */
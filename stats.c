@@ -0,0 +1,325 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "connection.h"
+#include "http.h"
+#include "stats.h"
+#include "util.h"
+
+/* the statuses counted, their order gives the index */
+static const enum status status[] = {
+	S_OK,
+	S_PARTIAL_CONTENT,
+	S_MOVED_PERMANENTLY,
+	S_NOT_MODIFIED,
+	S_BAD_REQUEST,
+	S_FORBIDDEN,
+	S_NOT_FOUND,
+	S_METHOD_NOT_ALLOWED,
+	S_REQUEST_TIMEOUT,
+	S_RANGE_NOT_SATISFIABLE,
+	S_REQUEST_TOO_LARGE,
+	S_INTERNAL_SERVER_ERROR,
+	S_VERSION_NOT_SUPPORTED,
+};
+
+static unsigned char statusidx[S_VERSION_NOT_SUPPORTED + 1];
+
+static const char *const type_str[] = {
+	[RESTYPE_ERROR]      = "error",
+	[RESTYPE_FILE]       = "file",
+	[RESTYPE_DIRLISTING] = "listing",
+};
+
+static const char *const cache_str[] = {
+	[STATS_LISTING] = "listing",
+	[STATS_GZIP]    = "gzip",
+	[STATS_FILE]    = "file",
+	[STATS_FD]      = "fd",
+	[STATS_TEMPL]   = "template",
+};
+
+/* upper bounds of the histogram buckets in microseconds */
+static const uint64_t bound[] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+	250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+
+struct histogram {
+	uint64_t bucket[LEN(bound) + 1]; /* not cumulative, last is +Inf */
+	uint64_t sum;                    /* microseconds */
+};
+
+struct slot {
+	uint64_t requests[NUM_RES_TYPES][LEN(status)];
+	uint64_t bytes[NUM_RES_TYPES];
+	struct histogram duration[NUM_RES_TYPES];
+	struct histogram render;
+	uint64_t cache[NUM_STATS_CACHES][2]; /* misses, hits */
+	int64_t connections;
+};
+
+/* slots are a multiple of a cache line apart, so workers don't share one */
+#define SLOT_SIZE ((sizeof(struct slot) + 63) & ~(size_t)63)
+
+static char *slots;
+static size_t nslots;
+static struct slot *slot; /* of this process, NULL if nothing is counted */
+
+#define ADD(x, n) __atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+#define GET(x)    __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+static struct slot *
+slot_at(size_t i)
+{
+	return (struct slot *)(slots + i * SLOT_SIZE);
+}
+
+/* create the slots for n workers, before they are forked */
+int
+stats_create(size_t n)
+{
+	size_t i;
+	void *p;
+
+	if ((p = mmap(NULL, n * SLOT_SIZE, PROT_READ | PROT_WRITE,
+	              MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		warn("mmap:");
+		return 1;
+	}
+	slots = p;
+	nslots = n;
+
+	for (i = 0; i < LEN(status); i++) {
+		statusidx[status[i]] = i;
+	}
+
+	return 0;
+}
+
+/*
+ * pick the slot of worker i, for the processes forked after it. A
+ * respawned worker keeps the counters of the one it replaces; only the
+ * open connections, which died with it, are reset
+ */
+void
+stats_worker(size_t i)
+{
+	if (!slots || i >= nslots) {
+		return;
+	}
+	slot = slot_at(i);
+	__atomic_store_n(&slot->connections, 0, __ATOMIC_RELAXED);
+}
+
+void
+stats_connection(int n)
+{
+	if (slot) {
+		ADD(slot->connections, n);
+	}
+}
+
+static void
+observe(struct histogram *h, uint64_t us)
+{
+	size_t i;
+
+	for (i = 0; i < LEN(bound) && us > bound[i]; i++)
+		;
+	ADD(h->bucket[i], 1);
+	ADD(h->sum, us);
+}
+
+static uint64_t
+since(const struct timespec *start, clockid_t clock)
+{
+	struct timespec now;
+	int64_t us;
+
+	clock_gettime(clock, &now);
+	us = (int64_t)(now.tv_sec - start->tv_sec) * 1000000 +
+	     (now.tv_nsec - start->tv_nsec) / 1000;
+
+	return MAX(us, 0);
+}
+
+void
+stats_request(const struct connection *c)
+{
+	enum res_type t = c->res.type;
+	enum status s = c->res.status;
+
+	if (!slot) {
+		return;
+	}
+	if ((size_t)s < LEN(statusidx) && status[statusidx[s]] == s) {
+		ADD(slot->requests[t][statusidx[s]], 1);
+	}
+	ADD(slot->bytes[t], c->buf.sent);
+
+	/* a connection dropped before its request was complete took none */
+	if (c->start.tv_sec) {
+		observe(&slot->duration[t], since(&c->start, CLOCK_REALTIME));
+	}
+}
+
+void
+stats_cache(enum stats_cache k, int hit)
+{
+	if (slot) {
+		ADD(slot->cache[k][hit != 0], 1);
+	}
+}
+
+/* a listing was rendered, starting at the monotonic time start */
+void
+stats_render(const struct timespec *start)
+{
+	if (slot) {
+		observe(&slot->render, since(start, CLOCK_MONOTONIC));
+	}
+}
+
+static void
+sum_histogram(struct histogram *to, const struct histogram *h)
+{
+	size_t i;
+
+	for (i = 0; i < LEN(to->bucket); i++) {
+		to->bucket[i] += GET(h->bucket[i]);
+	}
+	to->sum += GET(h->sum);
+}
+
+static void
+print_histogram(FILE *fp, const char *name, const char *label,
+                const struct histogram *h)
+{
+	uint64_t n = 0;
+	size_t i;
+
+	for (i = 0; i < LEN(h->bucket); i++) {
+		n += h->bucket[i];
+		if (i < LEN(bound)) {
+			fprintf(fp, "%s_bucket{%s%sle=\"%g\"} %ju\n", name,
+			        label, *label ? "," : "", bound[i] / 1e6,
+			        (uintmax_t)n);
+		} else {
+			fprintf(fp, "%s_bucket{%s%sle=\"+Inf\"} %ju\n", name,
+			        label, *label ? "," : "", (uintmax_t)n);
+		}
+	}
+	fprintf(fp, "%s_sum%s%s%s %.6f\n", name, *label ? "{" : "", label,
+	        *label ? "}" : "", h->sum / 1e6);
+	fprintf(fp, "%s_count%s%s%s %ju\n", name, *label ? "{" : "", label,
+	        *label ? "}" : "", (uintmax_t)n);
+}
+
+/* render the sum of all slots in the Prometheus text format */
+int
+stats_print(char **data, size_t *len)
+{
+	struct slot *sum, *p;
+	FILE *fp;
+	size_t i, j, t;
+	uint64_t n;
+	char label[32];
+
+	if (!slots || !(sum = calloc(1, sizeof(*sum)))) {
+		return 1;
+	}
+	for (i = 0; i < nslots; i++) {
+		p = slot_at(i);
+		for (t = 0; t < NUM_RES_TYPES; t++) {
+			for (j = 0; j < LEN(status); j++) {
+				sum->requests[t][j] += GET(p->requests[t][j]);
+			}
+			sum->bytes[t] += GET(p->bytes[t]);
+			sum_histogram(&sum->duration[t], &p->duration[t]);
+		}
+		sum_histogram(&sum->render, &p->render);
+		for (j = 0; j < NUM_STATS_CACHES; j++) {
+			sum->cache[j][0] += GET(p->cache[j][0]);
+			sum->cache[j][1] += GET(p->cache[j][1]);
+		}
+		sum->connections += GET(p->connections);
+	}
+
+	*data = NULL;
+	*len = 0;
+	if (!(fp = open_memstream(data, len))) {
+		free(sum);
+		return 1;
+	}
+
+	fputs("# HELP dirl_requests_total Requests answered.\n"
+	      "# TYPE dirl_requests_total counter\n", fp);
+	for (t = 0; t < NUM_RES_TYPES; t++) {
+		for (j = 0; j < LEN(status); j++) {
+			if (sum->requests[t][j]) {
+				fprintf(fp, "dirl_requests_total{type=\"%s\","
+				        "status=\"%d\"} %ju\n", type_str[t],
+				        status[j],
+				        (uintmax_t)sum->requests[t][j]);
+			}
+		}
+	}
+
+	fputs("# HELP dirl_sent_bytes_total Bytes sent, headers included.\n"
+	      "# TYPE dirl_sent_bytes_total counter\n", fp);
+	for (t = 0; t < NUM_RES_TYPES; t++) {
+		fprintf(fp, "dirl_sent_bytes_total{type=\"%s\"} %ju\n",
+		        type_str[t], (uintmax_t)sum->bytes[t]);
+	}
+
+	fprintf(fp, "# HELP dirl_connections Open client connections.\n"
+	        "# TYPE dirl_connections gauge\n"
+	        "dirl_connections %jd\n", (intmax_t)sum->connections);
+
+	fputs("# HELP dirl_request_duration_seconds From the complete "
+	      "request header to the last byte sent.\n"
+	      "# TYPE dirl_request_duration_seconds histogram\n", fp);
+	for (t = 0; t < NUM_RES_TYPES; t++) {
+		snprintf(label, sizeof(label), "type=\"%s\"", type_str[t]);
+		print_histogram(fp, "dirl_request_duration_seconds", label,
+		                &sum->duration[t]);
+	}
+
+	fputs("# HELP dirl_listing_render_seconds Rendering a listing "
+	      "that was not cached.\n"
+	      "# TYPE dirl_listing_render_seconds histogram\n", fp);
+	print_histogram(fp, "dirl_listing_render_seconds", "", &sum->render);
+
+	fputs("# HELP dirl_cache_lookups_total Cache lookups.\n"
+	      "# TYPE dirl_cache_lookups_total counter\n", fp);
+	for (j = 0; j < NUM_STATS_CACHES; j++) {
+		fprintf(fp, "dirl_cache_lookups_total{cache=\"%s\","
+		        "result=\"hit\"} %ju\n"
+		        "dirl_cache_lookups_total{cache=\"%s\","
+		        "result=\"miss\"} %ju\n", cache_str[j],
+		        (uintmax_t)sum->cache[j][1], cache_str[j],
+		        (uintmax_t)sum->cache[j][0]);
+	}
+	fputs("# HELP dirl_cache_hit_ratio Hits among all cache lookups.\n"
+	      "# TYPE dirl_cache_hit_ratio gauge\n", fp);
+	for (j = 0; j < NUM_STATS_CACHES; j++) {
+		n = sum->cache[j][0] + sum->cache[j][1];
+		fprintf(fp, "dirl_cache_hit_ratio{cache=\"%s\"} %g\n",
+		        cache_str[j], n ? (double)sum->cache[j][1] / n : 0.0);
+	}
+
+	free(sum);
+	if (fclose(fp)) {
+		free(*data);
+		*data = NULL;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,34 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <time.h>
+
+#include "connection.h"
+
+/*
+ * Counters shared by all processes serving requests. Each worker adds
+ * to a slot of its own with relaxed atomic operations, so they never
+ * contend, and the slots are only summed up when the metrics are
+ * asked for. Nothing is counted unless stats_create() was called.
+ */
+
+enum stats_cache {
+	STATS_LISTING, /* rendered listings */
+	STATS_GZIP,    /* compressed files */
+	STATS_FILE,    /* small files sent from memory */
+	STATS_FD,      /* path lookups and descriptors */
+	STATS_TEMPL,   /* listing templates */
+	NUM_STATS_CACHES,
+};
+
+int stats_create(size_t);
+void stats_worker(size_t);
+void stats_connection(int);
+void stats_request(const struct connection *);
+void stats_cache(enum stats_cache, int);
+void stats_render(const struct timespec *);
+int stats_print(char **, size_t *);
+
+#endif /* STATS_H */
@@ -0,0 +1,244 @@
+/* See LICENSE file for copyright and license details. */
+/*
+ * Checks the kernels in escape.c against bytewise implementations of
+ * the same rules, at every length around the vector width, every
+ * alignment and position of a special byte, every truncation and on
+ * random strings. With "bench" as argument it times both instead.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../escape.h"
+
+#define LEN(x) (sizeof(x) / sizeof(*(x)))
+#define MAXLEN 100
+
+static const char *const entity[256] = {
+	['&'] = "&amp;", ['<'] = "&lt;", ['>'] = "&gt;", ['"'] = "&quot;",
+	['\''] = "&#x27;",
+};
+
+static int
+hexval(int c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	} else if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	} else if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+static size_t
+ref_decode(const char *src, char *dst)
+{
+	size_t i, j;
+
+	for (i = 0, j = 0; src[i]; j++) {
+		if (src[i] == '%' && hexval(src[i + 1]) >= 0 &&
+		    hexval(src[i + 2]) >= 0) {
+			dst[j] = hexval(src[i + 1]) << 4 | hexval(src[i + 2]);
+			i += 3;
+		} else {
+			dst[j] = src[i++];
+		}
+	}
+	dst[j] = '\0';
+
+	return j;
+}
+
+static size_t
+ref_encode(const char *src, char *dst, size_t siz)
+{
+	size_t i, j;
+	unsigned char c;
+
+	for (i = 0, j = 0; src[i]; i++) {
+		c = src[i];
+		if (c < 0x20 || c >= 0x7f) {
+			if (siz - 1 - j < 3) {
+				break;
+			}
+			j += sprintf(dst + j, "%%%02X", c);
+		} else {
+			if (j == siz - 1) {
+				break;
+			}
+			dst[j++] = c;
+		}
+	}
+	dst[j] = '\0';
+
+	return j;
+}
+
+static size_t
+ref_html(const char *src, char *dst, size_t siz)
+{
+	size_t i, j, elen;
+	const char *e;
+
+	for (i = 0, j = 0; src[i]; i++) {
+		if ((e = entity[(unsigned char)src[i]])) {
+			if ((elen = strlen(e)) > siz - 1 - j) {
+				break;
+			}
+			memcpy(dst + j, e, elen);
+			j += elen;
+		} else {
+			if (j == siz - 1) {
+				break;
+			}
+			dst[j++] = src[i];
+		}
+	}
+	dst[j] = '\0';
+
+	return j;
+}
+
+static int failed;
+
+/* compare both on src, with dst of size siz where it is bounded */
+static void
+check(const char *src, size_t siz)
+{
+	static char a[MAXLEN * 6 + 64], b[MAXLEN * 6 + 64];
+	size_t la, lb;
+
+	la = ref_decode(src, a);
+	lb = url_decode(src, b);
+	if (la != lb || strcmp(a, b)) {
+		fprintf(stderr, "url_decode differs on \"%s\"\n", src);
+		failed = 1;
+	}
+	la = ref_encode(src, a, siz);
+	lb = url_encode(src, b, siz);
+	if (la != lb || strcmp(a, b)) {
+		fprintf(stderr, "url_encode differs on \"%s\", %zu\n", src, siz);
+		failed = 1;
+	}
+	la = ref_html(src, a, siz);
+	lb = html_escape(src, b, siz);
+	if (la != lb || strcmp(a, b)) {
+		fprintf(stderr, "html_escape differs on \"%s\", %zu\n", src, siz);
+		failed = 1;
+	}
+}
+
+static void
+test(void)
+{
+	static const char special[] = "%<>&\"'\x01\x7f\x80\xff";
+	static char buf[MAXLEN + 64];
+	char *s;
+	size_t len, pos, off, siz, k, n;
+
+	for (len = 0; len <= MAXLEN; len++) {
+		/* starting at buf + off, the loads hit every alignment */
+		for (off = 0; off < 32; off += (len < 40) ? 1 : 7) {
+			s = buf + off;
+			memset(s, 'a', len);
+			s[len] = '\0';
+			check(s, MAXLEN * 6);
+
+			/* one special byte at each position */
+			for (pos = 0; pos < len; pos++) {
+				for (k = 0; k < LEN(special) - 1; k++) {
+					s[pos] = special[k];
+					check(s, MAXLEN * 6);
+				}
+				/* a valid escape */
+				if (pos + 2 < len) {
+					memcpy(s + pos, "%4a", 3);
+					check(s, MAXLEN * 6);
+					memset(s + pos + 1, 'a', 2);
+				}
+				s[pos] = 'a';
+			}
+		}
+	}
+
+	/* truncation */
+	strcpy(buf, "0123456789abcde<f\x01" "ghijklmnopqrstu&vwxyz\xff"
+	       "ABCDEFGHIJKLMNOP");
+	for (siz = 1; siz < 120; siz++) {
+		check(buf, siz);
+	}
+
+	/* random strings rich in special bytes */
+	srand(1);
+	for (n = 0; n < 100000; n++) {
+		len = rand() % MAXLEN;
+		s = buf + rand() % 32;
+		for (pos = 0; pos < len; pos++) {
+			s[pos] = (rand() % 4) ? "%4aZ0 /<&"[rand() % 9] :
+			         (char)(rand() % 255 + 1);
+		}
+		s[len] = '\0';
+		check(s, (rand() % 2) ? MAXLEN * 6 : (size_t)rand() % 80 + 1);
+	}
+}
+
+static double
+now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static volatile size_t sink;
+
+#define RUN(name, expr) do { \
+	double t0 = now(); \
+	for (i = 0; i < N; i++) { \
+		sink += (expr); \
+	} \
+	printf("  %-12s %7.1f ns\n", name, (now() - t0) * 1e9 / N); \
+} while (0)
+
+static void
+bench(void)
+{
+	static const char *const cases[][2] = {
+		{ "name 24B", "photo_2023-01-01_trip.jpg" },
+		{ "path 120B", "/pub/mirror/debian/pool/main/l/linux-signed-"
+		  "amd64/linux-image-6.1.0-13-amd64_6.1.55-1_amd64.deb/extra/"
+		  "files/x" },
+		{ "path 120B, 6 escapes", "/pub/mirror/%C3%A9t%C3%A9/pool/main/"
+		  "l/linux-signed-amd64/<linux>-image-6.1.0-13-amd64_6.1.55-1_"
+		  "amd64.deb/&extra%20files" },
+	};
+	static char out[4096];
+	size_t c, i, N = 2000000;
+
+	for (c = 0; c < LEN(cases); c++) {
+		printf("%s\n", cases[c][0]);
+		RUN("decode ref", ref_decode(cases[c][1], out));
+		RUN("decode", url_decode(cases[c][1], out));
+		RUN("encode ref", ref_encode(cases[c][1], out, sizeof(out)));
+		RUN("encode", url_encode(cases[c][1], out, sizeof(out)));
+		RUN("html ref", ref_html(cases[c][1], out, sizeof(out)));
+		RUN("html", html_escape(cases[c][1], out, sizeof(out)));
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		bench();
+		return 0;
+	}
+	test();
+
+	return failed;
+}
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Checks the escape kernels built scalar, with SSE2 and with AVX2 against
+# bytewise implementations; variants the compiler or CPU lacks are skipped.
+# With "bench" as argument each variant is timed instead.
+set -e
+
+cc=${CC:-cc}
+cflags="-std=c99 -O2 -D_DEFAULT_SOURCE -D_XOPEN_SOURCE=700"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+for variant in scalar:-mno-sse2 sse2: avx2:-mavx2; do
+	name=${variant%%:*}
+	flags=${variant#*:}
+	if ! echo 'int x;' | $cc $flags -x c -c - -o /dev/null 2>/dev/null; then
+		echo "escape: $name: not supported by $cc, skipped"
+		continue
+	fi
+	$cc $cflags $flags -c escape.c -o "$dir/$name.o"
+	$cc $cflags tests/escape.c "$dir/$name.o" -o "$dir/$name"
+	if [ "$name" = avx2 ] && ! grep -qw avx2 /proc/cpuinfo 2>/dev/null; then
+		echo "escape: $name: not supported by this CPU, skipped"
+		continue
+	fi
+	if [ "$1" = bench ]; then
+		echo "-- $name"
+		"$dir/$name" bench
+	else
+		"$dir/$name"
+		echo "escape: $name: ok"
+	fi
+done
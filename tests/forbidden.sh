@@ -0,0 +1,28 @@
+#!/bin/sh
+# An unreadable file gets a complete 403 and the connection stays usable.
+# Run as root from the source directory, dirl chroots into its servedir.
+set -e
+
+port=${PORT:-8089}
+dir=$(mktemp -d)
+trap 'kill $pid 2>/dev/null; rm -rf "$dir"' EXIT
+
+echo hello > "$dir/ok.txt"
+: > "$dir/secret"
+chmod 0000 "$dir/secret"
+chmod 0755 "$dir"
+
+./dirl -p "$port" -h 127.0.0.1 -d "$dir" -g nogroup -w 1 >/dev/null 2>&1 &
+pid=$!
+sleep 1
+
+# both requests go over one persistent connection
+out=$(curl -s -o /dev/null -o /dev/null -w '%{http_code} %{size_download} %{num_connects}\n' \
+      "http://127.0.0.1:$port/secret" "http://127.0.0.1:$port/ok.txt")
+expected="403 121 1
+200 6 0"
+if [ "$out" != "$expected" ]; then
+	printf 'forbidden: got\n%s\nexpected\n%s\n' "$out" "$expected" >&2
+	exit 1
+fi
+echo "forbidden: ok"
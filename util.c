@@ -109,57 +109,64 @@ esnprintf(char *str, size_t size, const char *fmt, ...)
 }
 
 int
-prepend(char *str, size_t size, const char *prefix)
+buffer_append(struct buffer *buf, const char *s, size_t len)
 {
-  size_t len = strlen(str), prefixlen = strlen(prefix);
-
-  if (len + prefixlen + 1 > size) {
+  if (len > sizeof(buf->data) - buf->len) {
     return 1;
   }
-
-  memmove(str + prefixlen, str, len + 1);
-  memcpy(str, prefix, prefixlen);
+  memcpy(buf->data + buf->len, s, len);
+  buf->len += len;
 
   return 0;
 }
 
-void
-replace(char **src, const char *old, const char* new) {
-  int old_len = strlen(old);
-  int new_len = strlen(new);
-  int src_len = strlen(*src);
-
-  /* Count needed replacements */
-  const char* tmp = *src;
-  int replc=0;
-  while ((tmp=strstr(tmp, old))) {
-    replc++;
-    tmp += old_len;
-  }
+int
+buffer_appendf(struct buffer *buf, const char *suffixfmt, ...)
+{
+  va_list ap;
+  int ret;
 
-  /* Allocate enough space for the new string */
-  size_t buf_size = src_len + replc * (new_len - old_len) + 1;
-  char* buf = calloc(sizeof(char), buf_size);
+  va_start(ap, suffixfmt);
+  ret = vsnprintf(buf->data + buf->len,
+                  sizeof(buf->data) - buf->len, suffixfmt, ap);
+  va_end(ap);
 
-  /* Now start replacing */
-  const char *srcidx = *src;
-  const char *srcidx_old = *src;
-  char *bufidx = buf;
+  if (ret < 0 || (size_t)ret >= (sizeof(buf->data) - buf->len)) {
+    /* truncation occured, discard and error out */
+    memset(buf->data + buf->len, 0,
+           sizeof(buf->data) - buf->len);
+    return 1;
+  }
 
-  while (replc--) {
-    srcidx_old = strstr(srcidx, old);
+  /* increase buffer length by number of bytes written */
+  buf->len += ret;
 
-    long repl_len = labs(srcidx_old - srcidx);
-    bufidx = strncpy(bufidx, srcidx, repl_len) + repl_len;
-    bufidx = strcpy(bufidx, new) + new_len;
+  return 0;
+}
+
+int
+prepend(char *str, size_t size, const char *prefix)
+{
+  size_t len = strlen(str), prefixlen = strlen(prefix);
 
-    srcidx = srcidx_old+old_len;
+  if (len + prefixlen + 1 > size) {
+    return 1;
   }
 
-  strncpy(bufidx, srcidx, strlen(srcidx)); // copy tail
+  memmove(str + prefixlen, str, len + 1);
+  memcpy(str, prefix, prefixlen);
+
+  return 0;
+}
 
-  free(*src);
-  *src = buf;
+void
+fileid_set(struct fileid *id, const struct stat *st)
+{
+  /* clear the padding too, so ids can be compared with memcmp() */
+  memset(id, 0, sizeof(*id));
+  id->dev = st->st_dev;
+  id->ino = st->st_ino;
+  id->mtim = st->st_mtim;
 }
 
 char*
@@ -185,7 +192,7 @@ read_file(const char* path){
   rewind(tpl_fp);
 
   /* Read template into tpl_buf */
-  char* tpl_buf = (char*)calloc(sizeof(char), tpl_size);
+  char* tpl_buf = (char*)calloc(sizeof(char), tpl_size + 1);
 
   if (tpl_buf == NULL) {
     fclose(tpl_fp);
@@ -202,11 +209,12 @@ read_file(const char* path){
 
     fclose(tpl_fp);
     free(tpl_buf);
-    clearerr(tpl_fp);
 
     return NULL;
   }
 
+  fclose(tpl_fp);
+
   return tpl_buf;
 }
 
@@ -4,6 +4,7 @@
 
 #include <regex.h>
 #include <stddef.h>
+#include <sys/stat.h>
 #include <time.h>
 
 #include "arg.h"
@@ -32,6 +33,26 @@ struct server {
 	size_t vhost_len;
 	struct map *map;
 	size_t map_len;
+	struct cache *cache;
+	struct cache *filecache;
+	char *metrics; /* URI of the metrics, if they are served */
+	char *metricshost; /* canonical host of the vhost serving them */
+};
+
+/* general purpose buffer */
+#define BUFFER_SIZE 4096
+
+struct buffer {
+	char data[BUFFER_SIZE];
+	size_t len;
+	size_t sent; /* bytes of the response sent, with or without it */
+};
+
+/* identifies a version of a file, to notice when it has changed */
+struct fileid {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtim;
 };
 
 #undef MIN
@@ -51,9 +72,11 @@ void eunveil(const char *, const char *);
 
 int timestamp(char *, size_t, time_t);
 int esnprintf(char *, size_t, const char *, ...);
+int buffer_append(struct buffer *, const char *, size_t);
+int buffer_appendf(struct buffer *, const char *, ...);
 int prepend(char *, size_t, const char *);
-void replace(char **, const char *, const char *);
 char *read_file(const char* path);
+void fileid_set(struct fileid *, const struct stat *);
 
 void *reallocarray(void *, size_t, size_t);
 long long strtonum(const char *, long long, long long, const char **);
@@ -0,0 +1,117 @@
+/* See LICENSE file for copyright and license details. */
+#include <ctype.h>
+#include <regex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "config.h"
+#include "http.h"
+#include "util.h"
+#include "vhost.h"
+
+/* canonical hosts, open addressing, kept at most half full */
+static struct exact {
+	const char *chost;  /* NULL if the slot is unused */
+	struct vhost *vhost;
+} *exact;
+static size_t nexact;
+
+/* hosts matched by regex, each to a fixed slot */
+static struct memo {
+	char host[FIELD_MAX];
+	struct vhost *vhost;  /* NULL if no vhost matched */
+	int used;
+} memo[VHOST_MEMO];
+
+static size_t
+hash(const char *s)
+{
+	size_t h = 5381;
+
+	while (*s) {
+		h = h * 33 + (unsigned char)tolower((unsigned char)*s++);
+	}
+
+	return h;
+}
+
+static size_t
+find(const char *host)
+{
+	size_t i;
+
+	for (i = hash(host) & (nexact - 1);
+	     exact[i].chost && strcasecmp(exact[i].chost, host);
+	     i = (i + 1) & (nexact - 1))
+		;
+
+	return i;
+}
+
+/* the first vhost whose regex matches host, or NULL */
+static struct vhost *
+regex_match(const struct server *srv, const char *host)
+{
+	size_t i;
+
+	for (i = 0; i < srv->vhost_len; i++) {
+		if (!regexec(&(srv->vhost[i].re), host, 0, NULL, 0)) {
+			return &(srv->vhost[i]);
+		}
+	}
+
+	return NULL;
+}
+
+void
+vhost_init(const struct server *srv)
+{
+	struct vhost *vhost;
+	size_t i, j;
+
+	for (nexact = 16; nexact < 2 * srv->vhost_len; nexact *= 2)
+		;
+	if (!(exact = calloc(nexact, sizeof(*exact)))) {
+		die("calloc:");
+	}
+
+	/*
+	 * a canonical host leads to the vhost the regexes pick for it,
+	 * which need not be its own when an earlier regex matches too
+	 */
+	for (i = 0; i < srv->vhost_len; i++) {
+		if (!(vhost = regex_match(srv, srv->vhost[i].chost)) ||
+		    exact[j = find(srv->vhost[i].chost)].chost) {
+			continue;
+		}
+		exact[j].chost = srv->vhost[i].chost;
+		exact[j].vhost = vhost;
+	}
+}
+
+struct vhost *
+vhost_match(const struct server *srv, const char *host)
+{
+	struct memo *m;
+	struct vhost *vhost;
+	size_t i;
+
+	if (exact[i = find(host)].chost) {
+		return exact[i].vhost;
+	}
+
+	m = &memo[hash(host) % LEN(memo)];
+	if (m->used && !strcmp(m->host, host)) {
+		return m->vhost;
+	}
+
+	vhost = regex_match(srv, host);
+	if (strlen(host) < sizeof(m->host)) {
+		strcpy(m->host, host);
+		m->vhost = vhost;
+		m->used = 1;
+	}
+
+	return vhost;
+}
@@ -0,0 +1,17 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef VHOST_H
+#define VHOST_H
+
+#include "util.h"
+
+/*
+ * A Host header that is some vhost's canonical host is looked up in a
+ * hash table, any other is matched against the regexes in order. The
+ * table is filled before the workers are forked, and each worker
+ * remembers which vhost the other hosts it has seen matched.
+ */
+
+void vhost_init(const struct server *);
+struct vhost *vhost_match(const struct server *, const char *);
+
+#endif /* VHOST_H */